@@ -0,0 +1,163 @@
+-- codec throughput benchmark
+--
+-- usage: luajit examples/codec_bench.lua [seconds] [filter]
+--
+-- For each shape, encodes and decodes repeatedly for about `seconds'
+-- (default 1) and prints one line per shape and direction, so runs on
+-- different commits can be diffed. KB/op is the Lua heap allocated per
+-- operation, measured with the collector stopped. Memory the codec
+-- allocates with malloc (its scratch buffers) isn't included.
+
+local luv = require("luv")
+
+local secs   = tonumber(arg and arg[1]) or 1
+local filter = arg and arg[2]
+
+local function now()
+   return luv.hrtime() / 1e9
+end
+
+local shapes = { }
+local function shape(name, make, codec)
+   shapes[#shapes + 1] = { name = name, make = make, codec = codec }
+end
+
+local generic = { encode = luv.codec.encode, decode = luv.codec.decode }
+
+shape("flat_array", function()
+   local t = { }
+   for i = 1, 1000 do t[i] = i * 0.5 end
+   return t
+end)
+
+shape("nested_map", function()
+   local function node(depth)
+      local t = { name = "node", depth = depth }
+      if depth > 0 then
+         for i = 1, 4 do t["child"..i] = node(depth - 1) end
+      end
+      return t
+   end
+   return node(4)
+end)
+
+shape("string_records", function()
+   local t = { }
+   for i = 1, 200 do
+      t[i] = {
+         id      = i,
+         user    = "user"..i.."@example.com",
+         subject = "re: quarterly numbers for team "..(i % 7),
+         body    = string.rep("lorem ipsum dolor sit amet ", 4),
+      }
+   end
+   return t
+end)
+
+shape("cyclic_graph", function()
+   local nodes = { }
+   for i = 1, 200 do nodes[i] = { id = i } end
+   for i = 1, 200 do
+      nodes[i].next = nodes[i % 200 + 1]
+      nodes[i].prev = nodes[(i - 2) % 200 + 1]
+      nodes[i].root = nodes[1]
+   end
+   return nodes
+end)
+
+shape("closure", function()
+   local conf = { host = "localhost", port = 8080, retries = 3 }
+   local count = 0
+   return function(x)
+      count = count + 1
+      return conf.host, conf.port + x, count
+   end
+end)
+
+shape("codec_userdata", function()
+   local t = { }
+   for i = 1, 100 do
+      local u = newproxy(true)
+      getmetatable(u).__codec = function(o)
+         return "luv:bench:point", i
+      end
+      t[i] = u
+   end
+   return t
+end)
+debug.getregistry()["luv:bench:point"] = function(v)
+   return { x = v }
+end
+
+shape("typed_array", function()
+   local a = luv.array("double", 10000)
+   for i = 1, #a do a[i] = i end
+   return a
+end)
+
+do
+   local point = luv.codec.schema{
+      { "x", "number" }, { "y", "number" }, { "label", "string" }
+   }
+   shape("schema_record", function()
+      return { x = 1.5, y = -2.25, label = "waypoint" }
+   end, {
+      encode = function(v) return point:encode(v) end,
+      decode = function(s) return point:decode(s) end,
+   })
+   shape("generic_record", function()
+      return { x = 1.5, y = -2.25, label = "waypoint" }
+   end)
+end
+
+do
+   local encode = luv.codec.encoder{ compress = true }
+   shape("string_records_lz", shapes[3].make, {
+      encode = encode, decode = luv.codec.decode,
+   })
+end
+
+-- run `fn' for about `secs', returns ops, elapsed and KB allocated
+local function measure(fn)
+   local n, iter = 0, 1
+   local elapsed, kb = 0, 0
+   collectgarbage("collect")
+   while elapsed < secs do
+      collectgarbage("stop")
+      local m0 = collectgarbage("count")
+      local t0 = now()
+      for i = 1, iter do fn() end
+      elapsed = elapsed + (now() - t0)
+      kb = kb + (collectgarbage("count") - m0)
+      collectgarbage("restart")
+      collectgarbage("collect")
+      n = n + iter
+      if iter < 65536 then iter = iter * 2 end
+   end
+   return n, elapsed, kb
+end
+
+local function report(name, dir, n, elapsed, kb, size)
+   print(string.format("%-18s %-6s %10.0f ops/s %9.1f MB/s %10.1f KB/op %8d bytes",
+      name, dir, n / elapsed, n * size / elapsed / 1e6, kb / n, size))
+end
+
+print(string.format("# %s, %gs per case", jit and jit.version or _VERSION, secs))
+for _, s in ipairs(shapes) do
+   if not filter or s.name:find(filter, 1, true) then
+      local codec = s.codec or generic
+      local value = s.make()
+      local str   = codec.encode(value)
+      local size  = #str
+
+      local n, elapsed, kb = measure(function()
+         codec.encode(value)
+      end)
+      report(s.name, "encode", n, elapsed, kb, size)
+
+      n, elapsed, kb = measure(function()
+         codec.decode(str)
+      end)
+      report(s.name, "decode", n, elapsed, kb, size)
+   end
+end
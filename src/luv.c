@@ -117,6 +117,21 @@ static int luv_hrtime(lua_State* L) {
   return 1;
 }
 
+/* read buffer pool counters for the calling thread's loop */
+static int luv_pool_stats(lua_State* L) {
+  luv_pool_t* pool = &luvL_thread_self(L)->pool;
+  lua_createtable(L, 0, 4);
+  lua_pushinteger(L, pool->hits);
+  lua_setfield(L, -2, "hits");
+  lua_pushinteger(L, pool->misses);
+  lua_setfield(L, -2, "misses");
+  lua_pushinteger(L, pool->trims);
+  lua_setfield(L, -2, "trims");
+  lua_pushinteger(L, pool->bytes);
+  lua_setfield(L, -2, "bytes");
+  return 1;
+}
+
 static int luv_self(lua_State* L) {
   lua_pushthread(L);
   lua_gettable(L, LUA_REGISTRYINDEX);
@@ -224,6 +239,7 @@ luaL_Reg luv_funcs[] = {
   {"mem_free",            luv_mem_free},
   {"mem_total",           luv_mem_total},
   {"hrtime",              luv_hrtime},
+  {"pool_stats",          luv_pool_stats},
   {"self",                luv_self},
   {"sleep",               luv_sleep},
   {"interface_addresses", luv_interface_addresses},
@@ -324,6 +340,16 @@ LUALIB_API int luaopen_luv(lua_State *L) {
   /* luv */
   luvL_new_module(L, "luv", luv_funcs);
 
+  /* luv.array */
+  luaL_register(L, NULL, luv_array_funcs);
+  luvL_new_class(L, LUV_ARRAY_T, luv_array_meths);
+  lua_pop(L, 1);
+
+  /* luv.buffer */
+  luaL_register(L, NULL, luv_buffer_funcs);
+  luvL_new_class(L, LUV_BUFFER_T, luv_buffer_meths);
+  lua_pop(L, 1);
+
   /* luv.thread */
   luvL_new_module(L, "luv_thread", luv_thread_funcs);
   lua_setfield(L, -2, "thread");
@@ -331,6 +357,7 @@ LUALIB_API int luaopen_luv(lua_State *L) {
   lua_pop(L, 1);
 
   if (!MAIN_INITIALIZED) {
+    luvL_dns_init();
     luvL_thread_init_main(L);
     lua_pop(L, 1);
   }
@@ -352,6 +379,10 @@ LUALIB_API int luaopen_luv(lua_State *L) {
   /* luv.codec */
   luvL_new_module(L, "luv_codec", luv_codec_funcs);
   lua_setfield(L, -2, "codec");
+  luvL_new_class(L, LUV_DECODER_T, luv_decoder_meths);
+  lua_pop(L, 1);
+  luvL_new_class(L, LUV_SCHEMA_T, luv_schema_meths);
+  lua_pop(L, 1);
 
   /* luv.timer */
   luvL_new_module(L, "luv_timer", luv_timer_funcs);
@@ -371,6 +402,10 @@ LUALIB_API int luaopen_luv(lua_State *L) {
   luvL_new_class(L, LUV_FILE_T, luv_file_meths);
   lua_pop(L, 1);
 
+  /* luv.stream */
+  luvL_new_module(L, "luv_stream", luv_stream_funcs);
+  lua_setfield(L, -2, "stream");
+
   /* luv.pipe */
   luvL_new_module(L, "luv_pipe", luv_pipe_funcs);
   lua_setfield(L, -2, "pipe");
@@ -410,6 +445,10 @@ LUALIB_API int luaopen_luv(lua_State *L) {
   luvL_new_class(L, LUV_NET_TCP_T, luv_stream_meths);
   luaL_register(L, NULL, luv_net_tcp_meths);
   lua_pop(L, 1);
+  luvL_new_class(L, LUV_NET_UDP_T, luv_net_udp_meths);
+  lua_pop(L, 1);
+  luvL_new_class(L, LUV_NET_POOL_T, luv_net_pool_meths);
+  lua_pop(L, 1);
 
   /* luv.process */
   luvL_new_module(L, "luv_process", luv_process_funcs);
@@ -3,6 +3,7 @@
 
 #include <stdlib.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <string.h>
 #include <assert.h>
 
@@ -92,8 +93,13 @@ typedef union luv_req_u {
 #define LUV_PROCESS_T     "luv.process"
 #define LUV_NET_TCP_T     "luv.net.tcp"
 #define LUV_NET_UDP_T     "luv.net.udp"
+#define LUV_NET_POOL_T    "luv.net.pool"
 #define LUV_ZMQ_CTX_T     "luv.zmq.ctx"
 #define LUV_ZMQ_SOCKET_T  "luv.zmq.socket"
+#define LUV_ARRAY_T       "luv.array"
+#define LUV_BUFFER_T      "luv.buffer"
+#define LUV_DECODER_T     "luv.codec.decoder"
+#define LUV_SCHEMA_T      "luv.codec.schema"
 
 /* state flags */
 #define LUV_FSTART (1 << 0)
@@ -108,6 +114,31 @@ typedef union luv_req_u {
 #define LUV_ZMQ_XDUPCTX (1 << 1)
 #define LUV_ZMQ_WSEND   (1 << 2)
 #define LUV_ZMQ_WRECV   (1 << 3)
+#define LUV_ZMQ_XCOMPRESS (1 << 7)
+
+/* growable byte buffer, used by the codec */
+typedef struct luv_buf_s {
+  size_t   size;
+  uint8_t* head;
+  uint8_t* base;
+} luv_buf_t;
+
+/* codec flags */
+#define LUV_CODEC_FCOMPRESS (1 << 1) /* compress large payloads */
+
+/* payloads smaller than this are never compressed */
+#define LUV_CODEC_COMPRESS_MIN 1024
+
+/* destination for luvL_codec_encode_into, receives the encoded bytes.
+** If `take' is set it's used instead of `write' and given the block the
+** bytes were encoded into, which it owns from then on and must free() */
+typedef struct luv_sink_s luv_sink_t;
+struct luv_sink_s {
+  int   (*write)(luv_sink_t* sink, const char* data, size_t len);
+  int   (*take) (luv_sink_t* sink, char* data, size_t len, void* block);
+  int   flags;
+  void* data;
+};
 
 /* luv states */
 typedef struct luv_state_s  luv_state_t;
@@ -136,12 +167,50 @@ struct luv_state_s {
   LUV_STATE_FIELDS;
 };
 
+/* per-loop pool of read buffers, see luv_pool.c */
+#define LUV_POOL_CLASSES 8
+#define LUV_POOL_HIGH    (1 << 20)
+
+typedef struct luv_pool_s {
+  void*   free[LUV_POOL_CLASSES];
+  size_t  bytes;  /* held in the free lists */
+  size_t  hits;
+  size_t  misses;
+  size_t  trims;  /* released past the high water mark */
+} luv_pool_t;
+
+void        luvL_pool_init   (luv_pool_t* pool);
+void        luvL_pool_close  (luv_pool_t* pool);
+luv_pool_t* luvL_pool_self   (uv_loop_t* loop);
+uv_buf_t    luvL_pool_alloc  (luv_pool_t* pool, size_t size);
+void        luvL_pool_release(luv_pool_t* pool, uv_buf_t buf);
+
+/* passes handles from a thread's parent to the thread over a socket
+** pair, see luv_thread.c. The parent writes fd[0], the thread reads fd[1] */
+typedef struct luv_ipc_s {
+  int           fd[2];
+  uv_pipe_t*    send;   /* fd[0], in the parent's loop */
+  uv_pipe_t*    recv;   /* fd[1], in the thread's loop */
+  int           eof;
+  int           ref;    /* received handles nobody has asked for yet, */
+  int           head;   /* at [head + 1, tail] */
+  int           tail;
+  ngx_queue_t   wait;   /* states in recv_handle */
+  char          buf[64];
+} luv_ipc_t;
+
 struct luv_thread_s {
   LUV_STATE_FIELDS;
   luv_state_t*    curr;
   uv_thread_t     tid;
   uv_async_t      async;
-  uv_check_t      check;
+  uv_check_t      check;  /* flushes corked streams, see luv_stream.c */
+  ngx_queue_t     corked; /* streams with corked writes pending */
+  luv_buf_t       scratch;
+  luv_pool_t      pool;
+  size_t          accepted; /* connections accepted on this loop */
+  ngx_queue_t     resolving; /* lookups in flight, see luv_dns.c */
+  luv_ipc_t       ipc;
 };
 
 struct luv_fiber_s {
@@ -185,6 +254,190 @@ typedef struct luv_object_s {
   uv_buf_t      buf;
 } luv_object_t;
 
+/* stream read-ahead buffer. Reading continues until `high' bytes are
+** buffered and resumes below `low'. The buffered bytes are
+** base[rpos..wpos) */
+#define LUV_RBUF_HIGH (64 * 1024)
+#define LUV_RBUF_LOW  (16 * 1024)
+
+typedef struct luv_rbuf_s {
+  char*     base;
+  size_t    size;
+  size_t    rpos;
+  size_t    wpos;
+  size_t    scan;   /* delimiter search resumes here, relative to rpos */
+  size_t    high;
+  size_t    low;
+  int       paused; /* stopped at the high watermark */
+  int       eof;
+  uv_err_t  err;
+} luv_rbuf_t;
+
+/* asynchronous write request, pooled per stream */
+typedef struct luv_wreq_s luv_wreq_t;
+struct luv_wreq_s {
+  uv_write_t  req;
+  int         ref;   /* anchors the chunks until the write completes */
+  void*       block; /* or owns them, see stream:write_value */
+  luv_wreq_t* next;
+};
+
+/* stream write queue. With a `limit', writes return as soon as they're
+** queued and only suspend while more than `limit' bytes are unsent */
+#define LUV_WQUEUE_LIMIT (64 * 1024)
+
+/* corked chunks are flushed early once there are this many of them */
+#define LUV_CORK_IOV 256
+
+typedef struct luv_wqueue_s {
+  luv_wreq_t*   free;
+  size_t        limit;
+  int           active; /* requests in flight */
+  uv_err_t      err;    /* first failed write, reported once */
+  ngx_queue_t   drain;  /* writers waiting for the queue to drain */
+  ngx_queue_t   flush;  /* waiting for all writes to complete */
+  int           cork;   /* gather writes until the end of the loop iteration */
+  int           cref;   /* table of corked chunks, or LUA_NOREF */
+  int           ncork;
+  size_t        cbytes;
+  int           sref;   /* the stream, anchored while writes are pending */
+} luv_wqueue_t;
+
+/* listener state. Once accept_many is used, connections are accepted
+** as they arrive into the table `aref', at [ahead + 1, atail], until
+** LUV_ACCEPT_BACKLOG of them are waiting. With a `handler' each
+** connection is passed to a new fiber instead */
+#define LUV_ACCEPT_BACKLOG 1024
+
+typedef struct luv_accept_s {
+  int           aref;
+  int           ahead;
+  int           atail;
+  int           handler;
+} luv_accept_t;
+
+/* luv.stream.splice, forwards everything read from `src' to `dst' */
+typedef struct luv_splice_s {
+  luv_object_t* src;
+  luv_object_t* dst;
+  luv_state_t*  state;   /* waiting in splice */
+  size_t        bytes;   /* written so far */
+  int           pending; /* writes in flight */
+  int           paused;  /* reading stopped while dst drains */
+  int           done;    /* src ended or a write failed */
+  uv_err_t      err;
+} luv_splice_t;
+
+/* stream:sendfile. When the socket is full, a chunk of the file goes
+** through the stream's own write queue to wait for it to drain */
+typedef struct luv_sendfile_s {
+  uv_write_t    req;
+  uv_buf_t      buf;     /* that chunk, from the loop's pool */
+  size_t        len;
+  luv_object_t* stream;
+  luv_state_t*  state;   /* waiting in sendfile */
+  int           fd;      /* the file */
+  int64_t       offset;
+  size_t        left;
+  size_t        bytes;   /* sent so far */
+  int           err;     /* errno of a failed transfer */
+} luv_sendfile_t;
+
+/* per-stream I/O state, kept in `data' of stream objects */
+typedef struct luv_stream_io_s {
+  luv_rbuf_t    rbuf;
+  luv_wqueue_t  wqueue;
+  luv_accept_t  accept;
+  luv_splice_t* splice;  /* set while this is the source of a splice */
+  luv_sendfile_t* sendfile; /* set while a sendfile is in progress */
+  luv_object_t* object; /* the owning stream */
+  ngx_queue_t   corked; /* link in the thread's corked streams */
+} luv_stream_io_t;
+
+/* udp receive queue. Datagrams are read as libuv reports them, and on
+** Linux the rest of a burst is drained with recvmmsg in batches of up to
+** LUV_UDP_BATCH, into a ring of up to `size' of them. Datagrams arriving while the ring is full are
+** dropped and counted */
+#define LUV_UDP_RING  1024
+#define LUV_UDP_BATCH 16
+#define LUV_UDP_SLOT  (64 * 1024)
+
+typedef union luv_sockaddr_u {
+  struct sockaddr     sa;
+  struct sockaddr_in  in4;
+  struct sockaddr_in6 in6;
+} luv_sockaddr_t;
+
+typedef struct luv_dgram_s {
+  uv_buf_t        buf;  /* from the loop's pool */
+  size_t          len;
+  luv_sockaddr_t  peer;
+} luv_dgram_t;
+
+/* udp:send_many, datagrams not yet sent are msgs[next, n) */
+#define LUV_UDP_SEND_BATCH 64
+#define LUV_UDP_SEND_IOV   256
+
+typedef struct luv_udp_msg_s {
+  const char*     data; /* anchored by the caller's table */
+  size_t          len;
+  luv_sockaddr_t  addr; /* AF_UNSPEC for the peer of a connected socket */
+} luv_udp_msg_t;
+
+typedef struct luv_udp_send_s {
+  uv_udp_send_t   req;   /* a datagram sent by libuv while the socket is full */
+  ngx_queue_t     queue;
+  luv_state_t*    state; /* set once the sender is suspended */
+  luv_udp_msg_t*  msgs;
+  size_t          n;
+  size_t          next;
+  int             err;   /* errno of a failed send */
+} luv_udp_send_t;
+
+typedef struct luv_udp_io_s {
+  luv_object_t*   object;  /* the owning socket */
+  luv_dgram_t*    ring;
+  size_t          size;
+  size_t          head;
+  size_t          count;
+  char*           scratch; /* LUV_UDP_BATCH slots of LUV_UDP_SLOT bytes */
+  size_t          received;
+  size_t          dropped;
+  size_t          batches; /* receive calls which returned datagrams */
+  ngx_queue_t     sendq;   /* pending send_many calls, oldest first */
+  int             connected;
+  luv_sockaddr_t  peer;    /* set by connect */
+  int             nogso;   /* segmentation offload was refused */
+  size_t          sent;
+  size_t          send_batches; /* send calls */
+} luv_udp_io_t;
+
+/* luv.net.pool, connected tcp objects to one upstream. At most `max'
+** are handed out or being connected at a time, further callers wait in
+** `waiters'. Released connections wait in `idle', most recently used
+** last, and are closed after `idle_timeout' ms */
+typedef struct luv_net_pool_s {
+  char*         host;
+  char          port[8];
+  int           max;
+  uint64_t      idle_timeout;
+  int           active;   /* handed out */
+  int           pending;  /* being connected */
+  int           nidle;
+  int           nwaiting;
+  int           closed;
+  ngx_queue_t   idle;
+  ngx_queue_t   waiters;
+  uv_timer_t    timer;    /* closes expired idle connections */
+  size_t        acquired;
+  size_t        connects;
+  size_t        reused;
+  size_t        dead;     /* idle connections found closed or readable */
+  size_t        expired;
+  size_t        waited;   /* acquires which had to wait */
+  size_t        failed;   /* connects which failed */
+} luv_net_pool_t;
+
 typedef struct luv_chan_s {
   LUV_OBJECT_FIELDS;
   void*         put;
@@ -238,9 +491,43 @@ int  luvL_thread_once (luv_thread_t* self);
 void luvL_object_init (luv_state_t* state, luv_object_t* self);
 void luvL_object_close(luv_object_t* self);
 
+int  luvL_stream_start(luv_object_t* self);
 int  luvL_stream_stop (luv_object_t* self);
+luv_stream_io_t* luvL_stream_io(luv_object_t* self);
+luv_object_t* luvL_stream_accept_new(lua_State* L, uv_stream_t* server, uv_handle_type type);
 void luvL_stream_free (luv_object_t* self);
 void luvL_stream_close(luv_object_t* self);
+int  luvL_stream_alive(luv_object_t* self);
+
+#ifndef WIN32
+int  luvL_net_setsockopt(lua_State* L);
+int  luvL_net_getsockopt(lua_State* L);
+#endif
+
+/* typed numeric arrays */
+#define LUV_ARRAY_DOUBLE 0
+#define LUV_ARRAY_INT32  1
+#define LUV_ARRAY_UINT8  2
+
+typedef struct luv_array_s {
+  int       type;
+  size_t    length; /* in elements */
+  size_t    size;   /* in bytes */
+  uint8_t*  data;
+} luv_array_t;
+
+luv_array_t* luvL_array_new (lua_State* L, int type, size_t length);
+luv_array_t* luvL_array_test(lua_State* L, int idx);
+size_t       luvL_array_width(int type);
+
+/* mutable byte buffers, see luv_buffer.c */
+typedef struct luv_buffer_s {
+  size_t    size;
+  uint8_t*  data;
+} luv_buffer_t;
+
+luv_buffer_t* luvL_buffer_new (lua_State* L, size_t size);
+luv_buffer_t* luvL_buffer_test(lua_State* L, int idx);
 
 typedef ngx_queue_t luv_cond_t;
 
@@ -249,8 +536,49 @@ int luvL_cond_wait      (luv_cond_t* cond, luv_state_t* curr);
 int luvL_cond_signal    (luv_cond_t* cond);
 int luvL_cond_broadcast (luv_cond_t* cond);
 
-int luvL_codec_encode(lua_State* L, int narg);
-int luvL_codec_decode(lua_State* L);
+luv_buf_t* luvL_buf_new  (size_t size);
+void       luvL_buf_close(luv_buf_t* buf);
+void       luvL_buf_need (luv_buf_t* buf, size_t len);
+void       luvL_buf_put  (luv_buf_t* buf, uint8_t val);
+void       luvL_buf_write(luv_buf_t* buf, uint8_t* data, size_t len);
+
+
+/* resolver cache, see luv_dns.c. A waiter's `cb' gets the addresses
+** and the lookup's error, UV_OK on success */
+#define LUV_DNS_TTL          60
+#define LUV_DNS_NEGATIVE_TTL 5
+#define LUV_DNS_MAX          1024
+
+typedef struct luv_dns_waiter_s luv_dns_waiter_t;
+typedef void (*luv_dns_cb)(luv_dns_waiter_t* w, uv_err_t err,
+  const luv_sockaddr_t* addrs, int naddrs);
+
+struct luv_dns_waiter_s {
+  ngx_queue_t queue;
+  luv_dns_cb  cb;
+  void*       data;
+};
+
+typedef struct luv_dns_stats_s {
+  size_t  hits;
+  size_t  misses;
+  size_t  coalesced; /* misses which joined a lookup in flight */
+  size_t  entries;
+} luv_dns_stats_t;
+
+void luvL_dns_init  (void);
+int  luvL_dns_lookup(uv_loop_t* loop, const char* node, const char* service,
+                     const struct addrinfo* hints, luv_dns_waiter_t* w);
+void luvL_dns_ttl   (double ttl, double negative_ttl);
+void luvL_dns_flush (void);
+void luvL_dns_stats (luv_dns_stats_t* stats);
+
+int luvL_codec_encode     (lua_State* L, int narg);
+int luvL_codec_encode_into(lua_State* L, int narg, luv_sink_t* sink);
+int luvL_codec_decode     (lua_State* L);
+
+size_t luvL_lz_compress  (const uint8_t* src, size_t len, uint8_t* dst, size_t cap);
+int    luvL_lz_decompress(const uint8_t* src, size_t len, uint8_t* dst, size_t rawlen);
 
 int luvL_lib_decoder(lua_State* L);
 int luvL_zmq_ctx_decoder(lua_State* L);
@@ -276,6 +604,14 @@ extern luaL_Reg luv_cond_funcs[32];
 extern luaL_Reg luv_cond_meths[32];
 
 extern luaL_Reg luv_codec_funcs[32];
+extern luaL_Reg luv_decoder_meths[32];
+extern luaL_Reg luv_schema_meths[32];
+
+extern luaL_Reg luv_array_funcs[32];
+extern luaL_Reg luv_array_meths[32];
+
+extern luaL_Reg luv_buffer_funcs[32];
+extern luaL_Reg luv_buffer_meths[32];
 
 extern luaL_Reg luv_timer_funcs[32];
 extern luaL_Reg luv_timer_meths[32];
@@ -286,11 +622,13 @@ extern luaL_Reg luv_idle_meths[32];
 extern luaL_Reg luv_fs_funcs[32];
 extern luaL_Reg luv_file_meths[32];
 
+extern luaL_Reg luv_stream_funcs[32];
 extern luaL_Reg luv_stream_meths[32];
 
 extern luaL_Reg luv_net_funcs[32];
 extern luaL_Reg luv_net_tcp_meths[32];
 extern luaL_Reg luv_net_udp_meths[32];
+extern luaL_Reg luv_net_pool_meths[32];
 
 extern luaL_Reg luv_pipe_funcs[32];
 extern luaL_Reg luv_pipe_meths[32];
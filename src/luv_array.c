@@ -0,0 +1,193 @@
+#include "luv.h"
+
+static const char* LUV_ARRAY_TYPES[] = { "double", "int32", "uint8", NULL };
+
+static const size_t LUV_ARRAY_WIDTH[] = {
+  sizeof(double),
+  sizeof(int32_t),
+  sizeof(uint8_t)
+};
+
+size_t luvL_array_width(int type) {
+  return LUV_ARRAY_WIDTH[type];
+}
+
+luv_array_t* luvL_array_new(lua_State* L, int type, size_t length) {
+  size_t size;
+  luv_array_t* self;
+  if (length > (SIZE_MAX - sizeof(luv_array_t)) / LUV_ARRAY_WIDTH[type]) {
+    luaL_error(L, "array too large");
+  }
+  size = length * LUV_ARRAY_WIDTH[type];
+  self = (luv_array_t*)lua_newuserdata(L, sizeof(luv_array_t) + size);
+  luaL_getmetatable(L, LUV_ARRAY_T);
+  lua_setmetatable(L, -2);
+
+  self->type   = type;
+  self->length = length;
+  self->size   = size;
+  self->data   = (uint8_t*)(self + 1);
+  memset(self->data, 0, size);
+
+  return self;
+}
+
+/* like luaL_checkudata, but returns NULL instead of raising an error */
+luv_array_t* luvL_array_test(lua_State* L, int idx) {
+  void* self = lua_touserdata(L, idx);
+  if (self && lua_getmetatable(L, idx)) {
+    luaL_getmetatable(L, LUV_ARRAY_T);
+    if (!lua_rawequal(L, -1, -2)) self = NULL;
+    lua_pop(L, 2);
+    return (luv_array_t*)self;
+  }
+  return NULL;
+}
+
+static void luv_array_push(lua_State* L, luv_array_t* self, size_t i) {
+  switch (self->type) {
+    case LUV_ARRAY_DOUBLE:
+      lua_pushnumber(L, ((double*)self->data)[i]);
+      break;
+    case LUV_ARRAY_INT32:
+      lua_pushinteger(L, ((int32_t*)self->data)[i]);
+      break;
+    case LUV_ARRAY_UINT8:
+      lua_pushinteger(L, self->data[i]);
+      break;
+  }
+}
+
+static void luv_array_store(lua_State* L, luv_array_t* self, size_t i, int idx) {
+  switch (self->type) {
+    case LUV_ARRAY_DOUBLE:
+      ((double*)self->data)[i] = luaL_checknumber(L, idx);
+      break;
+    case LUV_ARRAY_INT32:
+      ((int32_t*)self->data)[i] = (int32_t)luaL_checkinteger(L, idx);
+      break;
+    case LUV_ARRAY_UINT8:
+      self->data[i] = (uint8_t)luaL_checkinteger(L, idx);
+      break;
+  }
+}
+
+/* luv.array(type, length|table) */
+static int luv_new_array(lua_State* L) {
+  int type = luaL_checkoption(L, 1, NULL, LUV_ARRAY_TYPES);
+  size_t i, length;
+  luv_array_t* self;
+
+  if (lua_istable(L, 2)) {
+    length = lua_objlen(L, 2);
+    self = luvL_array_new(L, type, length);
+    for (i = 0; i < length; i++) {
+      lua_rawgeti(L, 2, i + 1);
+      luv_array_store(L, self, i, -1);
+      lua_pop(L, 1);
+    }
+  }
+  else {
+    lua_Integer n = luaL_checkinteger(L, 2);
+    luaL_argcheck(L, n >= 0 && (size_t)n <= SIZE_MAX / LUV_ARRAY_WIDTH[type], 2,
+      "length out of range");
+    luvL_array_new(L, type, (size_t)n);
+  }
+  return 1;
+}
+
+static int luv_array_index(lua_State* L) {
+  luv_array_t* self = (luv_array_t*)lua_touserdata(L, 1);
+  if (lua_type(L, 2) == LUA_TNUMBER) {
+    size_t i = (size_t)lua_tointeger(L, 2);
+    if (i < 1 || i > self->length) {
+      return luaL_error(L, "array index %d out of range", (int)i);
+    }
+    luv_array_push(L, self, i - 1);
+    return 1;
+  }
+  /* method lookup */
+  lua_getmetatable(L, 1);
+  lua_pushvalue(L, 2);
+  lua_rawget(L, -2);
+  return 1;
+}
+
+static int luv_array_newindex(lua_State* L) {
+  luv_array_t* self = (luv_array_t*)lua_touserdata(L, 1);
+  size_t i = (size_t)luaL_checkinteger(L, 2);
+  if (i < 1 || i > self->length) {
+    return luaL_error(L, "array index %d out of range", (int)i);
+  }
+  luv_array_store(L, self, i - 1, 3);
+  return 0;
+}
+
+static int luv_array_len(lua_State* L) {
+  luv_array_t* self = (luv_array_t*)luaL_checkudata(L, 1, LUV_ARRAY_T);
+  lua_pushinteger(L, self->length);
+  return 1;
+}
+
+static int luv_array_type(lua_State* L) {
+  luv_array_t* self = (luv_array_t*)luaL_checkudata(L, 1, LUV_ARRAY_T);
+  lua_pushstring(L, LUV_ARRAY_TYPES[self->type]);
+  return 1;
+}
+
+static int luv_array_fill(lua_State* L) {
+  luv_array_t* self = (luv_array_t*)luaL_checkudata(L, 1, LUV_ARRAY_T);
+  size_t i;
+  if (self->length) {
+    luv_array_store(L, self, 0, 2);
+    for (i = 1; i < self->length; i++) {
+      memcpy(self->data + i * LUV_ARRAY_WIDTH[self->type], self->data,
+        LUV_ARRAY_WIDTH[self->type]);
+    }
+  }
+  lua_settop(L, 1);
+  return 1;
+}
+
+static int luv_array_totable(lua_State* L) {
+  luv_array_t* self = (luv_array_t*)luaL_checkudata(L, 1, LUV_ARRAY_T);
+  size_t i;
+  lua_createtable(L, self->length, 0);
+  for (i = 0; i < self->length; i++) {
+    luv_array_push(L, self, i);
+    lua_rawseti(L, -2, i + 1);
+  }
+  return 1;
+}
+
+/* raw storage pointer, for use with the LuaJIT FFI. The array must be
+** kept alive for as long as the pointer is in use */
+static int luv_array_pointer(lua_State* L) {
+  luv_array_t* self = (luv_array_t*)luaL_checkudata(L, 1, LUV_ARRAY_T);
+  lua_pushlightuserdata(L, self->data);
+  return 1;
+}
+
+static int luv_array_tostring(lua_State* L) {
+  luv_array_t* self = (luv_array_t*)luaL_checkudata(L, 1, LUV_ARRAY_T);
+  lua_pushfstring(L, "userdata<%s<%s>[%d]>: %p", LUV_ARRAY_T,
+    LUV_ARRAY_TYPES[self->type], (int)self->length, self);
+  return 1;
+}
+
+luaL_Reg luv_array_funcs[] = {
+  {"array",     luv_new_array},
+  {NULL,        NULL}
+};
+
+luaL_Reg luv_array_meths[] = {
+  {"type",      luv_array_type},
+  {"fill",      luv_array_fill},
+  {"totable",   luv_array_totable},
+  {"pointer",   luv_array_pointer},
+  {"__index",   luv_array_index},
+  {"__newindex",luv_array_newindex},
+  {"__len",     luv_array_len},
+  {"__tostring",luv_array_tostring},
+  {NULL,        NULL}
+};
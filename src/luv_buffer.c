@@ -0,0 +1,328 @@
+#include "luv.h"
+
+/* luv.buffer, a fixed size mutable byte buffer which I/O can read into
+** without creating Lua strings. Positions are 1-based and inclusive,
+** negative ones count from the end, like string.sub. Slices share the
+** storage of their parent, which they keep alive in their environment */
+
+static const char* LUV_BUFFER_ENDIAN[] = { "little", "big", NULL };
+
+luv_buffer_t* luvL_buffer_new(lua_State* L, size_t size) {
+  luv_buffer_t* self = (luv_buffer_t*)lua_newuserdata(L, sizeof(luv_buffer_t) + size);
+  luaL_getmetatable(L, LUV_BUFFER_T);
+  lua_setmetatable(L, -2);
+
+  self->size = size;
+  self->data = (uint8_t*)(self + 1);
+  memset(self->data, 0, size);
+
+  return self;
+}
+
+/* like luaL_checkudata, but returns NULL instead of raising an error */
+luv_buffer_t* luvL_buffer_test(lua_State* L, int idx) {
+  void* self = lua_touserdata(L, idx);
+  if (self && lua_getmetatable(L, idx)) {
+    luaL_getmetatable(L, LUV_BUFFER_T);
+    if (!lua_rawequal(L, -1, -2)) self = NULL;
+    lua_pop(L, 2);
+    return (luv_buffer_t*)self;
+  }
+  return NULL;
+}
+
+/* the range [i, j] given by the optional args `ai' and `ai + 1', clamped
+** to the buffer. Returns the offset of `i' and sets `len' */
+static size_t buffer_range(lua_State* L, luv_buffer_t* self, int ai, size_t* len) {
+  lua_Integer size = (lua_Integer)self->size;
+  lua_Integer i = luaL_optinteger(L, ai, 1);
+  lua_Integer j = luaL_optinteger(L, ai + 1, -1);
+  if (i < 0) i += size + 1;
+  if (j < 0) j += size + 1;
+  if (i < 1) i = 1;
+  if (i > size) i = size + 1;
+  if (j > size) j = size;
+  *len = i <= j ? (size_t)(j - i + 1) : 0;
+  return (size_t)(i - 1);
+}
+
+/* offset of the `width' bytes at position arg `ai' */
+static size_t buffer_offset(lua_State* L, luv_buffer_t* self, int ai, size_t width) {
+  lua_Integer i = luaL_checkinteger(L, ai);
+  if (i < 1 || (size_t)i - 1 + width > self->size) {
+    luaL_error(L, "buffer position %d out of range", (int)i);
+  }
+  return (size_t)(i - 1);
+}
+
+static size_t buffer_width(lua_State* L, int ai, int def) {
+  int width = luaL_optint(L, ai, def);
+  if (width != 1 && width != 2 && width != 4 && width != 8) {
+    luaL_argerror(L, ai, "width must be 1, 2, 4 or 8");
+  }
+  return (size_t)width;
+}
+
+static uint64_t buffer_load(const uint8_t* p, size_t width, int big) {
+  uint64_t v = 0;
+  size_t k;
+  for (k = 0; k < width; k++) {
+    v |= (uint64_t)p[big ? width - 1 - k : k] << (8 * k);
+  }
+  return v;
+}
+
+static void buffer_store(uint8_t* p, size_t width, int big, uint64_t v) {
+  size_t k;
+  for (k = 0; k < width; k++) {
+    p[big ? width - 1 - k : k] = (uint8_t)(v >> (8 * k));
+  }
+}
+
+/* luv.buffer(size|string) */
+static int luv_new_buffer(lua_State* L) {
+  if (lua_type(L, 1) == LUA_TSTRING) {
+    size_t len;
+    const char* str = lua_tolstring(L, 1, &len);
+    luv_buffer_t* self = luvL_buffer_new(L, len);
+    memcpy(self->data, str, len);
+  }
+  else {
+    lua_Integer size = luaL_checkinteger(L, 1);
+    luaL_argcheck(L, size >= 0, 1, "size must not be negative");
+    luvL_buffer_new(L, (size_t)size);
+  }
+  return 1;
+}
+
+static int luv_buffer_index(lua_State* L) {
+  luv_buffer_t* self = (luv_buffer_t*)lua_touserdata(L, 1);
+  if (lua_type(L, 2) == LUA_TNUMBER) {
+    lua_pushinteger(L, self->data[buffer_offset(L, self, 2, 1)]);
+    return 1;
+  }
+  /* method lookup */
+  lua_getmetatable(L, 1);
+  lua_pushvalue(L, 2);
+  lua_rawget(L, -2);
+  return 1;
+}
+
+static int luv_buffer_newindex(lua_State* L) {
+  luv_buffer_t* self = (luv_buffer_t*)lua_touserdata(L, 1);
+  size_t ofs = buffer_offset(L, self, 2, 1);
+  self->data[ofs] = (uint8_t)luaL_checkinteger(L, 3);
+  return 0;
+}
+
+static int luv_buffer_len(lua_State* L) {
+  luv_buffer_t* self = (luv_buffer_t*)luaL_checkudata(L, 1, LUV_BUFFER_T);
+  lua_pushinteger(L, (lua_Integer)self->size);
+  return 1;
+}
+
+/* buf:sub([i], [j]), the bytes as a string */
+static int luv_buffer_sub(lua_State* L) {
+  luv_buffer_t* self = (luv_buffer_t*)luaL_checkudata(L, 1, LUV_BUFFER_T);
+  size_t len, ofs = buffer_range(L, self, 2, &len);
+  lua_pushlstring(L, (const char*)self->data + ofs, len);
+  return 1;
+}
+
+/* buf:slice([i], [j]), a buffer sharing the bytes */
+static int luv_buffer_slice(lua_State* L) {
+  luv_buffer_t* self = (luv_buffer_t*)luaL_checkudata(L, 1, LUV_BUFFER_T);
+  size_t len, ofs = buffer_range(L, self, 2, &len);
+  luv_buffer_t* slice = (luv_buffer_t*)lua_newuserdata(L, sizeof(luv_buffer_t));
+  luaL_getmetatable(L, LUV_BUFFER_T);
+  lua_setmetatable(L, -2);
+  slice->size = len;
+  slice->data = self->data + ofs;
+
+  lua_createtable(L, 1, 0);
+  lua_pushvalue(L, 1);
+  lua_rawseti(L, -2, 1);
+  lua_setfenv(L, -2);
+  return 1;
+}
+
+/* buf:find(str, [init]), plain search, returns the start and end of the
+** first match, or nil */
+static int luv_buffer_find(lua_State* L) {
+  luv_buffer_t* self = (luv_buffer_t*)luaL_checkudata(L, 1, LUV_BUFFER_T);
+  size_t nlen, len, ofs;
+  const char* needle = luaL_checklstring(L, 2, &nlen);
+  const uint8_t* p;
+  const uint8_t* e;
+
+  ofs = buffer_range(L, self, 3, &len);
+  p = self->data + ofs;
+  e = p + len;
+
+  if (!nlen) {
+    lua_pushinteger(L, ofs + 1);
+    lua_pushinteger(L, ofs);
+    return 2;
+  }
+  while ((size_t)(e - p) >= nlen && (p = memchr(p, needle[0], e - p - nlen + 1))) {
+    if (!memcmp(p, needle, nlen)) {
+      lua_pushinteger(L, p - self->data + 1);
+      lua_pushinteger(L, p - self->data + nlen);
+      return 2;
+    }
+    p++;
+  }
+  lua_pushnil(L);
+  return 1;
+}
+
+/* buf:fill(byte, [i], [j]) */
+static int luv_buffer_fill(lua_State* L) {
+  luv_buffer_t* self = (luv_buffer_t*)luaL_checkudata(L, 1, LUV_BUFFER_T);
+  int byte = (int)luaL_checkinteger(L, 2);
+  size_t len, ofs = buffer_range(L, self, 3, &len);
+  memset(self->data + ofs, byte, len);
+  lua_settop(L, 1);
+  return 1;
+}
+
+/* buf:write(str|buffer, [i]), copy bytes in at `i', returns the count */
+static int luv_buffer_write(lua_State* L) {
+  luv_buffer_t* self = (luv_buffer_t*)luaL_checkudata(L, 1, LUV_BUFFER_T);
+  luv_buffer_t* from = luvL_buffer_test(L, 2);
+  const char* src;
+  size_t len, ofs;
+
+  if (from) {
+    src = (const char*)from->data;
+    len = from->size;
+  }
+  else {
+    src = luaL_checklstring(L, 2, &len);
+  }
+  ofs = lua_isnoneornil(L, 3) ? 0 : buffer_offset(L, self, 3, 0);
+  if (len > self->size - ofs) len = self->size - ofs;
+  memmove(self->data + ofs, src, len);
+  lua_pushinteger(L, (lua_Integer)len);
+  return 1;
+}
+
+/* buf:read_int(i, [width], [endian]) and buf:read_uint(...), width
+** defaults to 4 and endian to "little" */
+static int buffer_read_int(lua_State* L, int sign) {
+  luv_buffer_t* self = (luv_buffer_t*)luaL_checkudata(L, 1, LUV_BUFFER_T);
+  size_t width = buffer_width(L, 3, 4);
+  int big = luaL_checkoption(L, 4, "little", LUV_BUFFER_ENDIAN);
+  uint64_t v = buffer_load(self->data + buffer_offset(L, self, 2, width), width, big);
+  if (sign) {
+    if (width < 8 && (v >> (8 * width - 1)) & 1) {
+      v |= ~(uint64_t)0 << (8 * width);
+    }
+    lua_pushnumber(L, (lua_Number)(int64_t)v);
+  }
+  else {
+    lua_pushnumber(L, (lua_Number)v);
+  }
+  return 1;
+}
+static int luv_buffer_read_int(lua_State* L) {
+  return buffer_read_int(L, 1);
+}
+static int luv_buffer_read_uint(lua_State* L) {
+  return buffer_read_int(L, 0);
+}
+
+/* buf:write_int(i, value, [width], [endian]), for signed and unsigned */
+static int luv_buffer_write_int(lua_State* L) {
+  luv_buffer_t* self = (luv_buffer_t*)luaL_checkudata(L, 1, LUV_BUFFER_T);
+  lua_Number value = luaL_checknumber(L, 3);
+  size_t width = buffer_width(L, 4, 4);
+  int big = luaL_checkoption(L, 5, "little", LUV_BUFFER_ENDIAN);
+  uint64_t v = value < 0 ? (uint64_t)(int64_t)value : (uint64_t)value;
+  buffer_store(self->data + buffer_offset(L, self, 2, width), width, big, v);
+  lua_settop(L, 1);
+  return 1;
+}
+
+/* buf:read_float(i, [width], [endian]), width 4 or 8 (the default) */
+static int luv_buffer_read_float(lua_State* L) {
+  luv_buffer_t* self = (luv_buffer_t*)luaL_checkudata(L, 1, LUV_BUFFER_T);
+  size_t width = buffer_width(L, 3, 8);
+  int big = luaL_checkoption(L, 4, "little", LUV_BUFFER_ENDIAN);
+  uint64_t v;
+  luaL_argcheck(L, width == 4 || width == 8, 3, "width must be 4 or 8");
+  v = buffer_load(self->data + buffer_offset(L, self, 2, width), width, big);
+  if (width == 4) {
+    uint32_t u = (uint32_t)v;
+    float f;
+    memcpy(&f, &u, sizeof f);
+    lua_pushnumber(L, f);
+  }
+  else {
+    double d;
+    memcpy(&d, &v, sizeof d);
+    lua_pushnumber(L, d);
+  }
+  return 1;
+}
+
+/* buf:write_float(i, value, [width], [endian]) */
+static int luv_buffer_write_float(lua_State* L) {
+  luv_buffer_t* self = (luv_buffer_t*)luaL_checkudata(L, 1, LUV_BUFFER_T);
+  lua_Number value = luaL_checknumber(L, 3);
+  size_t width = buffer_width(L, 4, 8);
+  int big = luaL_checkoption(L, 5, "little", LUV_BUFFER_ENDIAN);
+  uint64_t v;
+  luaL_argcheck(L, width == 4 || width == 8, 4, "width must be 4 or 8");
+  if (width == 4) {
+    float f = (float)value;
+    uint32_t u;
+    memcpy(&u, &f, sizeof u);
+    v = u;
+  }
+  else {
+    double d = (double)value;
+    memcpy(&v, &d, sizeof v);
+  }
+  buffer_store(self->data + buffer_offset(L, self, 2, width), width, big, v);
+  lua_settop(L, 1);
+  return 1;
+}
+
+/* raw storage pointer, for use with the LuaJIT FFI. The buffer must be
+** kept alive for as long as the pointer is in use */
+static int luv_buffer_pointer(lua_State* L) {
+  luv_buffer_t* self = (luv_buffer_t*)luaL_checkudata(L, 1, LUV_BUFFER_T);
+  lua_pushlightuserdata(L, self->data);
+  return 1;
+}
+
+static int luv_buffer_tostring(lua_State* L) {
+  luv_buffer_t* self = (luv_buffer_t*)luaL_checkudata(L, 1, LUV_BUFFER_T);
+  lua_pushfstring(L, "userdata<%s>[%d]: %p", LUV_BUFFER_T, (int)self->size, self);
+  return 1;
+}
+
+luaL_Reg luv_buffer_funcs[] = {
+  {"buffer",    luv_new_buffer},
+  {NULL,        NULL}
+};
+
+luaL_Reg luv_buffer_meths[] = {
+  {"sub",        luv_buffer_sub},
+  {"slice",      luv_buffer_slice},
+  {"find",       luv_buffer_find},
+  {"fill",       luv_buffer_fill},
+  {"write",      luv_buffer_write},
+  {"read_int",   luv_buffer_read_int},
+  {"read_uint",  luv_buffer_read_uint},
+  {"write_int",  luv_buffer_write_int},
+  {"read_float", luv_buffer_read_float},
+  {"write_float",luv_buffer_write_float},
+  {"pointer",    luv_buffer_pointer},
+  {"__index",    luv_buffer_index},
+  {"__newindex", luv_buffer_newindex},
+  {"__len",      luv_buffer_len},
+  {"__tostring", luv_buffer_tostring},
+  {NULL,         NULL}
+};
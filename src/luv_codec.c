@@ -6,13 +6,18 @@
 #define LUV_CODEC_TREF 1
 #define LUV_CODEC_TVAL 2
 #define LUV_CODEC_TUSR 3
+#define LUV_CODEC_TARRAY 5
 
-/* TODO: make this buffer stuff generic */
-typedef struct luv_buf_t {
-  size_t   size;
-  uint8_t* head;
-  uint8_t* base;
-} luv_buf_t;
+/* scratch buffers which grew beyond this are freed instead of kept */
+#define LUV_CODEC_SCRATCH_MAX (1 << 20)
+
+/* compressed payloads start with a non-canonical uleb128 zero, which the
+** encoder never produces for the argument count, followed by a flags byte
+** and the uleb128 raw and compressed lengths */
+#define LUV_CODEC_MAGIC0 0x80
+#define LUV_CODEC_MAGIC1 0x00
+#define LUV_CODEC_HLZ    (1 << 0)
+#define LUV_CODEC_HMAX   13
 
 static int encode_table(lua_State* L, luv_buf_t *buf, int seen);
 static int decode_table(lua_State* L, luv_buf_t* buf, int seen);
@@ -108,6 +113,60 @@ uint8_t luvL_buf_peek(luv_buf_t* buf) {
   return *buf->head;
 }
 
+/* get (creating if needed) a cache table in the registry */
+static void codec_cache(lua_State* L, const char* name, const char* mode) {
+  lua_getfield(L, LUA_REGISTRYINDEX, name);
+  if (lua_isnil(L, -1)) {
+    lua_pop(L, 1);
+    lua_newtable(L);
+    if (mode) {
+      lua_createtable(L, 0, 1);
+      lua_pushstring(L, mode);
+      lua_setfield(L, -2, "__mode");
+      lua_setmetatable(L, -2);
+    }
+    lua_pushvalue(L, -1);
+    lua_setfield(L, LUA_REGISTRYINDEX, name);
+  }
+}
+
+/* push the bytecode of the function on top, dumping only on first use */
+static void codec_dump(lua_State* L) {
+  codec_cache(L, "luv:codec:dumps", "k");
+  lua_pushvalue(L, -2);
+  lua_rawget(L, -2);
+  if (lua_isnil(L, -1)) {
+    luv_buf_t b; b.base = NULL; b.head = NULL; b.size = 0;
+    lua_pop(L, 1);
+
+    lua_pushvalue(L, -2);
+    lua_dump(L, (lua_Writer)luvL_writer, &b);
+    lua_pop(L, 1);
+
+    lua_pushlstring(L, (char*)b.base, b.head - b.base);
+    luvL_buf_close(&b);
+
+    lua_pushvalue(L, -3);
+    lua_pushvalue(L, -2);
+    lua_rawset(L, -4);
+  }
+  lua_remove(L, -2); /* cache */
+}
+
+/* write the function on top as bytecode */
+static void encode_proto(lua_State* L, luv_buf_t* buf) {
+  size_t len;
+  const char* code;
+
+  codec_dump(L);
+  code = lua_tolstring(L, -1, &len);
+
+  luvL_buf_put(buf, LUV_CODEC_TVAL);
+  luvL_buf_write_uleb128(buf, (uint32_t)len);
+  luvL_buf_write(buf, (uint8_t*)code, len);
+  lua_pop(L, 1);
+}
+
 #define encoder_seen(L, idx, seen) do {\
   int ref = lua_objlen(L, seen) + 1; \
   lua_pushboolean(L, 1); \
@@ -194,7 +253,6 @@ static void encode_value(lua_State* L, luv_buf_t* buf, int val, int seen) {
     }
     else {
       int i;
-      luv_buf_t b; b.base = NULL; b.head = NULL; b.size = 0;
       lua_Debug ar;
 
       lua_pop(L, 1); /* pop nil */
@@ -206,16 +264,7 @@ static void encode_value(lua_State* L, luv_buf_t* buf, int val, int seen) {
       }
 
       encoder_seen(L, -1, seen);
-
-      tag = LUV_CODEC_TVAL;
-      luvL_buf_put(buf, tag);
-
-      lua_dump(L, (lua_Writer)luvL_writer, &b);
-
-      len = (size_t)(b.head - b.base);
-      luvL_buf_write_uleb128(buf, (uint32_t)len);
-      luvL_buf_write(buf, b.base, len);
-      luvL_buf_close(&b);
+      encode_proto(L, buf);
 
       lua_newtable(L);
       for (i = 1; i <= ar.nups; i++) {
@@ -229,7 +278,30 @@ static void encode_value(lua_State* L, luv_buf_t* buf, int val, int seen) {
 
     break;
   }
-  case LUA_TUSERDATA:
+  case LUA_TUSERDATA: {
+    luv_array_t* arr = luvL_array_test(L, -1);
+    if (arr) {
+      lua_pushvalue(L, -1);
+      lua_rawget(L, seen);
+      if (!lua_isnil(L, -1)) {
+        luvL_buf_put(buf, LUV_CODEC_TREF);
+        luvL_buf_write_uleb128(buf, (uint32_t)lua_tointeger(L, -1));
+        lua_pop(L, 1); /* pop ref */
+      }
+      else {
+        /* arrays are native, the payload is a single memcpy */
+        lua_pop(L, 1); /* pop nil */
+        if (arr->length > 0xffffffffU) {
+          luaL_error(L, "array too large to encode");
+        }
+        encoder_seen(L, -1, seen);
+        luvL_buf_put(buf, LUV_CODEC_TARRAY);
+        luvL_buf_put(buf, (uint8_t)arr->type);
+        luvL_buf_write_uleb128(buf, (uint32_t)arr->length);
+        luvL_buf_write(buf, arr->data, arr->size);
+      }
+      break;
+    }
     if (luaL_getmetafield(L, -1, "__codec")) {
       encoder_hook(L, buf, seen);
       break;
@@ -237,6 +309,7 @@ static void encode_value(lua_State* L, luv_buf_t* buf, int val, int seen) {
     else {
       luaL_error(L, "cannot encode userdata\n");
     }
+  }
   case LUA_TNIL:
     /* type tag already written */
     break;
@@ -373,6 +446,23 @@ static void decode_value(lua_State* L, luv_buf_t* buf, int seen) {
   }
   case LUA_TUSERDATA: {
     uint8_t tag = luvL_buf_get(buf);
+    if (tag == LUV_CODEC_TREF) {
+      uint32_t ref = luvL_buf_read_uleb128(buf);
+      lua_rawgeti(L, seen, ref);
+      break;
+    }
+    if (tag == LUV_CODEC_TARRAY) {
+      int type = luvL_buf_get(buf);
+      size_t length = luvL_buf_read_uleb128(buf);
+      size_t left = buf->size - (size_t)(buf->head - buf->base);
+      if (type > LUV_ARRAY_UINT8 || length > left / luvL_array_width(type)) {
+        luaL_error(L, "bad code");
+      }
+      luv_array_t* arr = luvL_array_new(L, type, length);
+      memcpy(arr->data, luvL_buf_read(buf, arr->size), arr->size);
+      decoder_seen(L, -1, seen);
+      break;
+    }
     assert(tag == LUV_CODEC_TUSR);
     decode_value(L, buf, seen); /* hook */
     if (lua_type(L, -1) == LUA_TSTRING) {
@@ -411,9 +501,68 @@ static int decode_table(lua_State* L, luv_buf_t* buf, int seen) {
   return 1;
 }
 
-int luvL_codec_encode(lua_State* L, int narg) {
+/* borrow the thread's scratch buffer, detaching it so that a nested
+** encode (from within a __codec hook) gets a fresh one. If a sink took
+** the last one only its size is left, and a new one starts at that */
+static luv_thread_t* codec_buf_acquire(lua_State* L, luv_buf_t* buf) {
+  luv_state_t* state = luvL_state_self(L);
+  buf->base = NULL; buf->head = NULL; buf->size = 0;
+  if (!state) {
+    /* plain coroutine, not known to the scheduler */
+    return NULL;
+  }
+  while (state->type != LUV_TTHREAD) state = state->outer;
+  luv_thread_t* thread = (luv_thread_t*)state;
+  if (thread->scratch.base) {
+    *buf = thread->scratch;
+    buf->head = buf->base;
+  }
+  else if (thread->scratch.size) {
+    buf->size = thread->scratch.size;
+    buf->base = (uint8_t*)malloc(buf->size);
+    buf->head = buf->base;
+  }
+  thread->scratch.base = NULL;
+  thread->scratch.head = NULL;
+  thread->scratch.size = 0;
+  return thread;
+}
+
+/* `buf->base' is NULL if a sink took the bytes, but its size is kept */
+static void codec_buf_release(luv_thread_t* thread, luv_buf_t* buf) {
+  if (thread && !thread->scratch.base && buf->size <= LUV_CODEC_SCRATCH_MAX) {
+    thread->scratch = *buf;
+    thread->scratch.head = thread->scratch.base;
+  }
+  else {
+    luvL_buf_close(buf);
+  }
+}
+
+/* what a protected encode works on */
+typedef struct luv_codec_job_s {
+  luv_buf_t buf;
+} luv_codec_job_t;
+
+/* call `fn' with the top `narg' values and a job, whose buffer is the
+** scratch buffer, in protected mode. An error raised while encoding, by a
+** bad value or a __codec hook, gives the buffer back before it's passed
+** on. The caller releases the buffer to the returned thread when done */
+static luv_thread_t* codec_run(lua_State* L, lua_CFunction fn, int narg, luv_codec_job_t* job) {
+  luv_thread_t* thread = codec_buf_acquire(L, &job->buf);
+  lua_pushcfunction(L, fn);
+  lua_insert(L, -(narg + 1));
+  lua_pushlightuserdata(L, job);
+  if (lua_pcall(L, narg + 1, 0, 0)) {
+    codec_buf_release(thread, &job->buf);
+    lua_error(L);
+  }
+  return thread;
+}
+
+/* encode the top narg values into buf, popping them */
+static void encode_tuple(lua_State* L, luv_buf_t* buf, int narg) {
   int i, base, seen;
-  luv_buf_t buf; buf.base = NULL; buf.head = NULL; buf.size = 0;
 
   base = lua_gettop(L) - narg + 1;
 
@@ -421,32 +570,173 @@ int luvL_codec_encode(lua_State* L, int narg) {
   lua_insert(L, base);  /* seen */
   seen = base++;
 
-  luvL_buf_write_uleb128(&buf, narg);
+  luvL_buf_write_uleb128(buf, narg);
 
   for (i = base; i < base + narg; i++) {
-    encode_value(L, &buf, i, seen);
+    encode_value(L, buf, i, seen);
   }
 
-  lua_remove(L, seen);
-  lua_settop(L, seen);
+  lua_settop(L, seen - 1);
+}
+
+/* bounds checked uleb128 read, returns the number of bytes consumed,
+** 0 if the input ends first or -1 if it's malformed */
+static ptrdiff_t codec_scan_uleb128(const uint8_t* p, const uint8_t* e, uint32_t* val) {
+  ptrdiff_t n = 0;
+  uint32_t  v = 0;
+  while (p + n < e) {
+    uint8_t b = p[n];
+    v |= (uint32_t)(b & 0x7f) << (7 * n);
+    n++;
+    if (b < 0x80) {
+      *val = v;
+      return n;
+    }
+    if (n == 5) return -1;
+  }
+  return 0;
+}
 
-  lua_pushlstring(L, (char *)buf.base, buf.head - buf.base);
-  luvL_buf_close(&buf);
+static int codec_is_compressed(const uint8_t* p, size_t len) {
+  return len >= 2 && p[0] == LUV_CODEC_MAGIC0 && p[1] == LUV_CODEC_MAGIC1;
+}
 
+/* parse a compressed payload header, returns its length, 0 if the input
+** ends first or -1 if it's malformed */
+static ptrdiff_t codec_read_header(const uint8_t* p, const uint8_t* e,
+  uint32_t* rawlen, uint32_t* zlen) {
+  ptrdiff_t n, hlen = 3;
+  if (e - p < hlen) return 0;
+  if (!(p[2] & LUV_CODEC_HLZ)) return -1;
+  if ((n = codec_scan_uleb128(p + hlen, e, rawlen)) <= 0) return n;
+  hlen += n;
+  if ((n = codec_scan_uleb128(p + hlen, e, zlen)) <= 0) return n;
+  return hlen + n;
+}
+
+static size_t codec_put_uleb128(uint8_t* p, uint32_t val) {
+  size_t n = 0;
+  for (; val >= 0x80; val >>= 7) {
+    p[n++] = (uint8_t)((val & 0x7f) | 0x80);
+  }
+  p[n++] = (uint8_t)val;
+  return n;
+}
+
+/* hand the encoded bytes to the sink, compressing them first if the sink
+** asks for it and the payload is at least `threshold' bytes */
+static int codec_emit(luv_buf_t* buf, luv_sink_t* sink, size_t threshold) {
+  size_t len = buf->head - buf->base;
+  if ((sink->flags & LUV_CODEC_FCOMPRESS) && len >= threshold
+      && len > LUV_CODEC_HMAX) {
+    int rv;
+    size_t zlen, hlen;
+    uint8_t* out = (uint8_t*)malloc(len);
+
+    /* only keep it if it's actually smaller */
+    zlen = luvL_lz_compress(buf->base, len, out + LUV_CODEC_HMAX,
+      len - LUV_CODEC_HMAX);
+    if (zlen) {
+      uint8_t head[LUV_CODEC_HMAX];
+      head[0] = LUV_CODEC_MAGIC0;
+      head[1] = LUV_CODEC_MAGIC1;
+      head[2] = LUV_CODEC_HLZ;
+      hlen = 3;
+      hlen += codec_put_uleb128(head + hlen, (uint32_t)len);
+      hlen += codec_put_uleb128(head + hlen, (uint32_t)zlen);
+      memcpy(out + LUV_CODEC_HMAX - hlen, head, hlen);
+
+      if (sink->take) {
+        return sink->take(sink, (char*)out + LUV_CODEC_HMAX - hlen, hlen + zlen, out);
+      }
+      rv = sink->write(sink, (const char*)out + LUV_CODEC_HMAX - hlen, hlen + zlen);
+      free(out);
+      return rv;
+    }
+    free(out);
+  }
+  if (sink->take) {
+    uint8_t* block = buf->base;
+    buf->base = NULL;
+    buf->head = NULL;
+    return sink->take(sink, (char*)block, len, block);
+  }
+  return sink->write(sink, (const char*)buf->base, len);
+}
+
+static int codec_push_sink(luv_sink_t* sink, const char* data, size_t len) {
+  lua_pushlstring((lua_State*)sink->data, data, len);
   return 1;
 }
 
+static int codec_encode_tuple(lua_State* L) {
+  luv_codec_job_t* job = (luv_codec_job_t*)lua_touserdata(L, -1);
+  lua_pop(L, 1);
+  encode_tuple(L, &job->buf, lua_gettop(L));
+  return 0;
+}
+
+static int codec_encode(lua_State* L, int narg, luv_sink_t* sink, size_t threshold) {
+  int rv;
+  luv_codec_job_t job;
+  luv_thread_t* thread;
+
+  thread = codec_run(L, codec_encode_tuple, narg, &job);
+  rv = codec_emit(&job.buf, sink, threshold);
+
+  codec_buf_release(thread, &job.buf);
+  return rv;
+}
+
+int luvL_codec_encode(lua_State* L, int narg) {
+  luv_sink_t sink;
+  sink.write = codec_push_sink;
+  sink.take  = NULL;
+  sink.flags = 0;
+  sink.data  = L;
+  return codec_encode(L, narg, &sink, LUV_CODEC_COMPRESS_MIN);
+}
+
+/* like luvL_codec_encode, but hands the encoded bytes straight to `sink'
+** instead of pushing a Lua string, returns whatever the sink returns. A
+** sink with `take' gets the encode buffer itself, so nothing is copied */
+int luvL_codec_encode_into(lua_State* L, int narg, luv_sink_t* sink) {
+  return codec_encode(L, narg, sink, LUV_CODEC_COMPRESS_MIN);
+}
+
 int luvL_codec_decode(lua_State* L) {
   size_t len;
   int nval, seen, i;
   int top = lua_gettop(L);
-
-  luv_buf_t buf; buf.base = NULL; buf.head = NULL; buf.size = 0;
+  int temp = 0;
 
   const char* data = luaL_checklstring(L, 1, &len);
-  luvL_buf_init(&buf, (uint8_t*)data, len);
 
+  /* decode in place, the buffer is only read from */
+  luv_buf_t buf;
+  buf.base = (uint8_t*)data;
   buf.head = buf.base;
+  buf.size = len;
+
+  if (codec_is_compressed(buf.base, len)) {
+    uint32_t rawlen, zlen;
+    uint8_t* raw;
+    ptrdiff_t hlen = codec_read_header(buf.base, buf.base + len, &rawlen, &zlen);
+    if (hlen <= 0 || (size_t)hlen + zlen > len) {
+      return luaL_error(L, "bad code");
+    }
+
+    /* a userdata, so it's collected if decoding raises an error */
+    raw = (uint8_t*)lua_newuserdata(L, rawlen);
+    temp = lua_gettop(L);
+
+    if (luvL_lz_decompress(buf.base + hlen, zlen, raw, rawlen)) {
+      return luaL_error(L, "corrupt compressed payload");
+    }
+    buf.base = raw;
+    buf.head = raw;
+    buf.size = rawlen;
+  }
 
   lua_newtable(L);
   seen = lua_gettop(L);
@@ -458,6 +748,7 @@ int luvL_codec_decode(lua_State* L) {
     decode_value(L, &buf, seen);
   }
   lua_remove(L, seen);
+  if (temp) lua_remove(L, temp);
 
   assert(lua_gettop(L) == top + nval);
   return nval;
@@ -470,7 +761,593 @@ static int luv_codec_decode(lua_State* L) {
   return luvL_codec_decode(L);
 }
 
+static int luv_codec_encoder_call(lua_State* L) {
+  luv_sink_t sink;
+  sink.write = codec_push_sink;
+  sink.take  = NULL;
+  sink.flags = lua_tointeger(L, lua_upvalueindex(1));
+  sink.data  = L;
+  return codec_encode(L, lua_gettop(L), &sink,
+    (size_t)lua_tointeger(L, lua_upvalueindex(2)));
+}
+
+/* luv.codec.encoder{ compress = true, threshold = 1024 } */
+static int luv_codec_encoder(lua_State* L) {
+  int flags = 0;
+  lua_Integer threshold = LUV_CODEC_COMPRESS_MIN;
+
+  if (!lua_isnoneornil(L, 1)) {
+    luaL_checktype(L, 1, LUA_TTABLE);
+    lua_getfield(L, 1, "compress");
+    if (lua_toboolean(L, -1)) flags |= LUV_CODEC_FCOMPRESS;
+    lua_getfield(L, 1, "threshold");
+    if (!lua_isnil(L, -1)) threshold = luaL_checkinteger(L, -1);
+    lua_pop(L, 2);
+  }
+
+  lua_pushinteger(L, flags);
+  lua_pushinteger(L, threshold);
+  lua_pushcclosure(L, luv_codec_encoder_call, 2);
+  return 1;
+}
+
+/* Streaming decoder. Input is buffered as it arrives and a scanner
+** walks it token by token, keeping an explicit stack of open tables and
+** hooks, so that each byte is scanned once however the input is chunked.
+** Once a top-level value is complete it is decoded in place. */
+
+#define LUV_DECODER_FVALUES 0 /* `count' more values */
+#define LUV_DECODER_FBODY   1 /* table body, `count' is 1 after a key */
+
+typedef struct luv_decoder_frame_s {
+  int      kind;
+  uint32_t count;
+} luv_decoder_frame_t;
+
+typedef struct luv_decoder_s {
+  luv_buf_t  buf;   /* buffered input, base..head */
+  size_t     pos;   /* start of the unconsumed input */
+  size_t     scan;  /* end of the scanned part of the current value */
+  uint32_t   nval;  /* values left in the current message */
+  int        depth;
+  int        alloc;
+  luv_decoder_frame_t* stack;
+} luv_decoder_t;
+
+static void decoder_push(luv_decoder_t* self, int kind, uint32_t count) {
+  if (self->depth == self->alloc) {
+    self->alloc = self->alloc ? self->alloc * 2 : 16;
+    self->stack = (luv_decoder_frame_t*)realloc(self->stack,
+      self->alloc * sizeof(luv_decoder_frame_t));
+  }
+  self->stack[self->depth].kind  = kind;
+  self->stack[self->depth].count = count;
+  self->depth++;
+}
+
+/* length of the value header at p, and which frame (if any) its body
+** needs, see encode_value for the layout */
+static ptrdiff_t decoder_token(const uint8_t* p, const uint8_t* e, int* body) {
+  const uint8_t* s = p;
+  ptrdiff_t n;
+  uint32_t  len;
+
+#define TOKEN_NEED(size) do { \
+  if ((size_t)(e - p) < (size_t)(size)) return 0; \
+  p += (size); \
+} while (0)
+
+#define TOKEN_ULEB(v) do { \
+  if ((n = codec_scan_uleb128(p, e, &(v))) <= 0) return n; \
+  p += n; \
+} while (0)
+
+  *body = -1;
+  TOKEN_NEED(1);
+  switch (s[0]) {
+  case LUA_TNIL:
+    break;
+  case LUA_TBOOLEAN:
+    TOKEN_NEED(1);
+    break;
+  case LUA_TLIGHTUSERDATA:
+    TOKEN_NEED(sizeof(void*));
+    break;
+  case LUA_TNUMBER:
+    TOKEN_NEED(sizeof(lua_Number));
+    break;
+  case LUA_TSTRING:
+    TOKEN_ULEB(len);
+    TOKEN_NEED(len);
+    break;
+  case LUA_TTABLE:
+    TOKEN_NEED(1);
+    switch (p[-1]) {
+    case LUV_CODEC_TREF: TOKEN_ULEB(len); break;
+    case LUV_CODEC_TVAL: *body = LUV_DECODER_FBODY; break;
+    case LUV_CODEC_TUSR: *body = LUV_DECODER_FVALUES; break;
+    default: return -1;
+    }
+    break;
+  case LUA_TFUNCTION:
+    TOKEN_NEED(1);
+    switch (p[-1]) {
+    case LUV_CODEC_TREF:
+      TOKEN_ULEB(len);
+      break;
+    case LUV_CODEC_TVAL:
+      TOKEN_ULEB(len);
+      TOKEN_NEED(len);
+      *body = LUV_DECODER_FBODY;
+      break;
+    default:
+      return -1;
+    }
+    break;
+  case LUA_TUSERDATA:
+    TOKEN_NEED(1);
+    switch (p[-1]) {
+    case LUV_CODEC_TREF:
+      TOKEN_ULEB(len);
+      break;
+    case LUV_CODEC_TARRAY: {
+      int type;
+      TOKEN_NEED(1);
+      type = p[-1];
+      if (type > LUV_ARRAY_UINT8) return -1;
+      TOKEN_ULEB(len);
+      TOKEN_NEED((size_t)len * luvL_array_width(type));
+      break;
+    }
+    case LUV_CODEC_TUSR:
+      *body = LUV_DECODER_FVALUES;
+      break;
+    default:
+      return -1;
+    }
+    break;
+  default:
+    return -1;
+  }
+
+#undef TOKEN_NEED
+#undef TOKEN_ULEB
+
+  return p - s;
+}
+
+/* advance the scanner over the current value. Returns 1 once it is
+** complete, 0 if more input is needed and -1 on malformed input */
+static int decoder_scan(luv_decoder_t* self) {
+  const uint8_t* e = self->buf.head;
+  for (;;) {
+    luv_decoder_frame_t* f = &self->stack[self->depth - 1];
+    const uint8_t* p = self->buf.base + self->scan;
+    ptrdiff_t n;
+    int body;
+
+    if (f->kind == LUV_DECODER_FVALUES && f->count == 0) {
+      if (--self->depth == 0) return 1;
+      continue;
+    }
+    if (f->kind == LUV_DECODER_FBODY && f->count == 0) {
+      /* key position, nil is the sentinel */
+      if (p >= e) return 0;
+      if (*p == LUA_TNIL) {
+        self->scan++;
+        self->depth--;
+        continue;
+      }
+    }
+
+    n = decoder_token(p, e, &body);
+    if (n <= 0) return (int)n;
+    self->scan += n;
+
+    if (f->kind == LUV_DECODER_FVALUES) {
+      f->count--;
+    }
+    else {
+      f->count ^= 1;
+    }
+    if (body == LUV_DECODER_FBODY) {
+      decoder_push(self, LUV_DECODER_FBODY, 0);
+    }
+    else if (body == LUV_DECODER_FVALUES) {
+      decoder_push(self, LUV_DECODER_FVALUES, 2); /* hook and value */
+    }
+  }
+}
+
+/* replace the compressed message at the read position with its raw bytes.
+** Returns 1 on success, 0 if more input is needed and -1 if it's corrupt */
+static int decoder_inflate(luv_decoder_t* self) {
+  uint32_t  rawlen, zlen;
+  uint8_t*  p = self->buf.base + self->pos;
+  ptrdiff_t hlen = codec_read_header(p, self->buf.head, &rawlen, &zlen);
+  size_t    rest;
+  luv_buf_t raw;
+
+  if (hlen <= 0) return (int)hlen;
+  if ((size_t)(self->buf.head - p) < (size_t)hlen + zlen) return 0;
+
+  rest = self->buf.head - (p + hlen + zlen);
+  raw.base = NULL; raw.head = NULL; raw.size = 0;
+  luvL_buf_need(&raw, rawlen + rest);
+  if (luvL_lz_decompress(p + hlen, zlen, raw.base, rawlen)) {
+    luvL_buf_close(&raw);
+    return -1;
+  }
+  memcpy(raw.base + rawlen, p + hlen + zlen, rest);
+  raw.head = raw.base + rawlen + rest;
+
+  luvL_buf_close(&self->buf);
+  self->buf = raw;
+  self->pos = 0;
+  return 1;
+}
+
+/* luv.codec.decoder() */
+static int luv_new_decoder(lua_State* L) {
+  luv_decoder_t* self = (luv_decoder_t*)lua_newuserdata(L, sizeof(luv_decoder_t));
+  memset(self, 0, sizeof(luv_decoder_t));
+  luaL_getmetatable(L, LUV_DECODER_T);
+  lua_setmetatable(L, -2);
+
+  /* seen table of the current message lives in the environment */
+  lua_newtable(L);
+  lua_setfenv(L, -2);
+  return 1;
+}
+
+/* decoder:feed(data) */
+static int luv_decoder_feed(lua_State* L) {
+  luv_decoder_t* self = (luv_decoder_t*)luaL_checkudata(L, 1, LUV_DECODER_T);
+  size_t len;
+  const char* data = luaL_checklstring(L, 2, &len);
+
+  /* drop consumed input once it's at least half the buffer */
+  if (self->pos && self->pos >= (size_t)(self->buf.head - self->buf.base) / 2) {
+    size_t keep = self->buf.head - self->buf.base - self->pos;
+    memmove(self->buf.base, self->buf.base + self->pos, keep);
+    self->buf.head = self->buf.base + keep;
+    if (self->depth) self->scan -= self->pos;
+    self->pos = 0;
+  }
+  luvL_buf_write(&self->buf, (uint8_t*)data, len);
+  return 0;
+}
+
+/* decoder:next(), returns false if more input is needed, or true, the
+** next value and whether it was the last value of its message */
+static int luv_decoder_next(lua_State* L) {
+  luv_decoder_t* self = (luv_decoder_t*)luaL_checkudata(L, 1, LUV_DECODER_T);
+  luv_buf_t buf;
+  int rv;
+
+  while (!self->nval) {
+    uint8_t*  p = self->buf.base + self->pos;
+    uint32_t  nval;
+    ptrdiff_t n;
+
+    if (codec_is_compressed(p, self->buf.head - p)) {
+      rv = decoder_inflate(self);
+      if (rv < 0) return luaL_error(L, "corrupt compressed payload");
+      if (rv == 0) goto more;
+      continue;
+    }
+
+    n = codec_scan_uleb128(p, self->buf.head, &nval);
+    if (n < 0) return luaL_error(L, "bad code");
+    if (n == 0) goto more;
+    self->pos += n;
+    self->nval = nval;
+
+    /* fresh seen table for each message */
+    lua_getfenv(L, 1);
+    lua_newtable(L);
+    lua_rawseti(L, -2, 1);
+    lua_pop(L, 1);
+  }
+
+  if (!self->depth) {
+    self->scan = self->pos;
+    decoder_push(self, LUV_DECODER_FVALUES, 1);
+  }
+  rv = decoder_scan(self);
+  if (rv < 0) return luaL_error(L, "bad code");
+  if (rv == 0) goto more;
+
+  buf.base = self->buf.base + self->pos;
+  buf.head = buf.base;
+  buf.size = self->scan - self->pos;
+
+  lua_pushboolean(L, 1);
+  lua_getfenv(L, 1);
+  lua_rawgeti(L, -1, 1);
+  decode_value(L, &buf, lua_gettop(L));
+  lua_replace(L, -3);
+  lua_pop(L, 1);
+
+  self->pos = self->scan;
+  self->nval--;
+  lua_pushboolean(L, self->nval == 0);
+  return 3;
+
+more:
+  lua_pushboolean(L, 0);
+  return 1;
+}
+
+static int luv_decoder_free(lua_State* L) {
+  luv_decoder_t* self = (luv_decoder_t*)lua_touserdata(L, 1);
+  luvL_buf_close(&self->buf);
+  free(self->stack);
+  return 0;
+}
+
+static int luv_decoder_tostring(lua_State* L) {
+  luv_decoder_t* self = (luv_decoder_t*)luaL_checkudata(L, 1, LUV_DECODER_T);
+  lua_pushfstring(L, "userdata<%s>: %p", LUV_DECODER_T, self);
+  return 1;
+}
+
+/* Schema bound records. A schema fixes the field order and types of a
+** record shape, so the payload is a nil bitmap followed by the values
+** only, with no type bytes or keys for typed fields. */
+
+#define LUV_SCHEMA_ANY     0
+#define LUV_SCHEMA_NUMBER  1
+#define LUV_SCHEMA_STRING  2
+#define LUV_SCHEMA_BOOLEAN 3
+
+static const char* LUV_SCHEMA_TYPES[] = {
+  "any", "number", "string", "boolean", NULL
+};
+
+static const int LUV_SCHEMA_LUA_TYPES[] = {
+  LUA_TNONE, LUA_TNUMBER, LUA_TSTRING, LUA_TBOOLEAN
+};
+
+typedef struct luv_schema_s {
+  int     nfields;
+  int     nany;   /* number of untyped fields */
+  uint8_t types[1];
+} luv_schema_t;
+
+/* luv.codec.schema{ {"name", "type"}, ... } */
+static int luv_new_schema(lua_State* L) {
+  luv_schema_t* self;
+  int i, n;
+
+  luaL_checktype(L, 1, LUA_TTABLE);
+  n = lua_objlen(L, 1);
+
+  self = (luv_schema_t*)lua_newuserdata(L, sizeof(luv_schema_t) + n);
+  self->nfields = n;
+  self->nany    = 0;
+  luaL_getmetatable(L, LUV_SCHEMA_T);
+  lua_setmetatable(L, -2);
+
+  /* field names, in order, live in the environment */
+  lua_createtable(L, n, 0);
+  for (i = 1; i <= n; i++) {
+    lua_rawgeti(L, 1, i);
+    if (lua_type(L, -1) == LUA_TSTRING) {
+      self->types[i - 1] = LUV_SCHEMA_ANY;
+    }
+    else {
+      luaL_checktype(L, -1, LUA_TTABLE);
+      lua_rawgeti(L, -1, 2);
+      self->types[i - 1] = luaL_checkoption(L, -1, "any", LUV_SCHEMA_TYPES);
+      lua_pop(L, 1);
+      lua_rawgeti(L, -1, 1);
+      lua_replace(L, -2);
+    }
+    if (self->types[i - 1] == LUV_SCHEMA_ANY) self->nany++;
+    if (lua_type(L, -1) != LUA_TSTRING) {
+      return luaL_error(L, "schema field %d has no name", i);
+    }
+    lua_rawseti(L, -2, i);
+  }
+  lua_setfenv(L, -2);
+  return 1;
+}
+
+/* in protected mode, the stack is [ schema, record, names, [seen] ] */
+static int schema_encode_record(lua_State* L) {
+  luv_codec_job_t* job = (luv_codec_job_t*)lua_touserdata(L, -1);
+  luv_schema_t* self = (luv_schema_t*)lua_touserdata(L, 1);
+  luv_buf_t* buf = &job->buf;
+  size_t nmap = (self->nfields + 7) / 8;
+  size_t len;
+  int i, keys = 3, seen = self->nany ? 4 : 0;
+
+  lua_pop(L, 1);
+  luvL_buf_need(buf, nmap);
+  memset(buf->head, 0, nmap);
+  buf->head += nmap;
+
+  for (i = 0; i < self->nfields; i++) {
+    int type = self->types[i];
+    lua_rawgeti(L, keys, i + 1);
+    lua_rawget(L, 2);
+
+    if (lua_isnil(L, -1)) {
+      buf->base[i / 8] |= (uint8_t)(1 << (i % 8));
+      lua_pop(L, 1);
+      continue;
+    }
+    if (type != LUV_SCHEMA_ANY && lua_type(L, -1) != LUV_SCHEMA_LUA_TYPES[type]) {
+      lua_rawgeti(L, keys, i + 1);
+      return luaL_error(L, "field `%s' must be a %s", lua_tostring(L, -1),
+        LUV_SCHEMA_TYPES[type]);
+    }
+
+    switch (type) {
+    case LUV_SCHEMA_NUMBER: {
+      lua_Number v = lua_tonumber(L, -1);
+      luvL_buf_write(buf, (uint8_t*)(void*)&v, sizeof v);
+      break;
+    }
+    case LUV_SCHEMA_STRING: {
+      const char* str = lua_tolstring(L, -1, &len);
+      luvL_buf_write_uleb128(buf, (uint32_t)len);
+      luvL_buf_write(buf, (uint8_t*)str, len);
+      break;
+    }
+    case LUV_SCHEMA_BOOLEAN:
+      luvL_buf_put(buf, (uint8_t)lua_toboolean(L, -1));
+      break;
+    default:
+      encode_value(L, buf, -1, seen);
+      break;
+    }
+    lua_pop(L, 1);
+  }
+  return 0;
+}
+
+/* schema:encode(record) */
+static int luv_schema_encode(lua_State* L) {
+  luv_schema_t* self = (luv_schema_t*)luaL_checkudata(L, 1, LUV_SCHEMA_T);
+  luv_codec_job_t job;
+  luv_thread_t* thread;
+
+  luaL_checktype(L, 2, LUA_TTABLE);
+  lua_settop(L, 2);
+  lua_getfenv(L, 1);
+  if (self->nany) {
+    lua_newtable(L);
+  }
+
+  thread = codec_run(L, schema_encode_record, lua_gettop(L), &job);
+  lua_pushlstring(L, (char*)job.buf.base, job.buf.head - job.buf.base);
+  codec_buf_release(thread, &job.buf);
+  return 1;
+}
+
+/* length of the complete value at p, or -1 if it's truncated or
+** malformed, so that decode_value can be let loose on it */
+static ptrdiff_t codec_value_len(const uint8_t* p, const uint8_t* e) {
+  luv_decoder_t scan;
+  int rv;
+  memset(&scan, 0, sizeof(scan));
+  scan.buf.base = (uint8_t*)p;
+  scan.buf.head = (uint8_t*)e;
+  decoder_push(&scan, LUV_DECODER_FVALUES, 1);
+  rv = decoder_scan(&scan);
+  free(scan.stack);
+  return rv == 1 ? (ptrdiff_t)scan.scan : -1;
+}
+
+/* schema:decode(string) */
+static int luv_schema_decode(lua_State* L) {
+  luv_schema_t* self = (luv_schema_t*)luaL_checkudata(L, 1, LUV_SCHEMA_T);
+  size_t nmap = (self->nfields + 7) / 8;
+  size_t len;
+  int i, keys, rec, seen = 0;
+  uint32_t slen;
+  ptrdiff_t n;
+
+  const uint8_t* map = (const uint8_t*)luaL_checklstring(L, 2, &len);
+  const uint8_t* end = map + len;
+
+  luv_buf_t buf;
+  buf.base = (uint8_t*)map;
+  buf.head = buf.base + nmap;
+  buf.size = len;
+
+  if (len < nmap) goto bad;
+
+  lua_settop(L, 2);
+  lua_getfenv(L, 1);
+  keys = lua_gettop(L);
+  if (self->nany) {
+    lua_newtable(L);
+    seen = lua_gettop(L);
+  }
+  lua_createtable(L, 0, self->nfields);
+  rec = lua_gettop(L);
+
+  for (i = 0; i < self->nfields; i++) {
+    if (map[i / 8] & (1 << (i % 8))) continue;
+
+    lua_rawgeti(L, keys, i + 1);
+    switch (self->types[i]) {
+    case LUV_SCHEMA_NUMBER: {
+      lua_Number v;
+      if ((size_t)(end - buf.head) < sizeof v) goto bad;
+      memcpy(&v, luvL_buf_read(&buf, sizeof v), sizeof v);
+      lua_pushnumber(L, v);
+      break;
+    }
+    case LUV_SCHEMA_STRING:
+      if ((n = codec_scan_uleb128(buf.head, end, &slen)) <= 0) goto bad;
+      buf.head += n;
+      if ((size_t)(end - buf.head) < slen) goto bad;
+      lua_pushlstring(L, (const char*)luvL_buf_read(&buf, slen), slen);
+      break;
+    case LUV_SCHEMA_BOOLEAN:
+      if (buf.head >= end) goto bad;
+      lua_pushboolean(L, luvL_buf_get(&buf));
+      break;
+    default:
+      if (codec_value_len(buf.head, end) < 0) goto bad;
+      decode_value(L, &buf, seen);
+      break;
+    }
+    lua_rawset(L, rec);
+  }
+  return 1;
+
+bad:
+  return luaL_error(L, "bad code");
+}
+
+static int luv_schema_fields(lua_State* L) {
+  luv_schema_t* self = (luv_schema_t*)luaL_checkudata(L, 1, LUV_SCHEMA_T);
+  int i;
+  lua_getfenv(L, 1);
+  lua_createtable(L, self->nfields, 0);
+  for (i = 1; i <= self->nfields; i++) {
+    lua_createtable(L, 2, 0);
+    lua_rawgeti(L, -3, i);
+    lua_rawseti(L, -2, 1);
+    lua_pushstring(L, LUV_SCHEMA_TYPES[self->types[i - 1]]);
+    lua_rawseti(L, -2, 2);
+    lua_rawseti(L, -2, i);
+  }
+  return 1;
+}
+
+static int luv_schema_tostring(lua_State* L) {
+  luv_schema_t* self = (luv_schema_t*)luaL_checkudata(L, 1, LUV_SCHEMA_T);
+  lua_pushfstring(L, "userdata<%s>: %p", LUV_SCHEMA_T, self);
+  return 1;
+}
+
 luaL_Reg luv_codec_funcs[] = {
-  {"encode", luv_codec_encode},
-  {"decode", luv_codec_decode},
+  {"encode",  luv_codec_encode},
+  {"decode",  luv_codec_decode},
+  {"encoder", luv_codec_encoder},
+  {"decoder", luv_new_decoder},
+  {"schema",  luv_new_schema},
+  {NULL,      NULL}
+};
+
+luaL_Reg luv_schema_meths[] = {
+  {"encode",    luv_schema_encode},
+  {"decode",    luv_schema_decode},
+  {"fields",    luv_schema_fields},
+  {"__tostring",luv_schema_tostring},
+  {NULL,        NULL}
+};
+
+luaL_Reg luv_decoder_meths[] = {
+  {"feed",      luv_decoder_feed},
+  {"next",      luv_decoder_next},
+  {"__gc",      luv_decoder_free},
+  {"__tostring",luv_decoder_tostring},
+  {NULL,        NULL}
 };
@@ -0,0 +1,252 @@
+#include "luv.h"
+
+/* Process wide cache of getaddrinfo results, shared by all threads.
+** getaddrinfo doesn't report record TTLs, so answers are kept for a
+** fixed `ttl' and failures for `negative_ttl'. Lookups of the same name
+** from one loop while a request is in flight wait for that request
+** instead of starting their own. Entries are evicted oldest first once
+** there are LUV_DNS_MAX of them. */
+
+#define LUV_DNS_BUCKETS 256
+
+typedef struct luv_dns_entry_s {
+  struct luv_dns_entry_s* next;  /* in the bucket */
+  ngx_queue_t     lru;           /* oldest first */
+  uint32_t        hash;
+  uint64_t        expires;       /* uv_hrtime() */
+  uv_err_t        err;
+  luv_sockaddr_t* addrs;
+  int             naddrs;
+  char            key[1];
+} luv_dns_entry_t;
+
+/* a request in flight, in its thread's `resolving' list */
+typedef struct luv_dns_req_s {
+  uv_getaddrinfo_t req;
+  ngx_queue_t      link;
+  ngx_queue_t      waiters;
+  char             key[1];
+} luv_dns_req_t;
+
+static luv_dns_entry_t* dns_store[LUV_DNS_BUCKETS];
+static ngx_queue_t      dns_lru;
+static uv_mutex_t       dns_mutex;
+static luv_dns_stats_t  dns_stats;
+static uint64_t         dns_ttl          = LUV_DNS_TTL * (uint64_t)1e9;
+static uint64_t         dns_negative_ttl = LUV_DNS_NEGATIVE_TTL * (uint64_t)1e9;
+
+void luvL_dns_init(void) {
+  uv_mutex_init(&dns_mutex);
+  ngx_queue_init(&dns_lru);
+}
+
+static uint32_t dns_hash(const char* key) {
+  uint32_t h = 2166136261U;
+  for (; *key; key++) h = (h ^ (uint8_t)*key) * 16777619U;
+  return h;
+}
+
+/* the cache key covers the hints which change the answer */
+static char* dns_key(const char* node, const char* service, const struct addrinfo* hints) {
+  size_t len = 64 + (node ? strlen(node) : 0) + (service ? strlen(service) : 0);
+  char*  key = (char*)malloc(len);
+  snprintf(key, len, "%d/%d/%d/%s/%s",
+    hints->ai_family, hints->ai_socktype, hints->ai_protocol,
+    node ? node : "", service ? service : "");
+  return key;
+}
+
+/* with the mutex held */
+static luv_dns_entry_t** dns_find(const char* key, uint32_t hash) {
+  luv_dns_entry_t** e = &dns_store[hash % LUV_DNS_BUCKETS];
+  for (; *e; e = &(*e)->next) {
+    if ((*e)->hash == hash && !strcmp((*e)->key, key)) break;
+  }
+  return e;
+}
+
+static void dns_remove(luv_dns_entry_t** e) {
+  luv_dns_entry_t* entry = *e;
+  *e = entry->next;
+  ngx_queue_remove(&entry->lru);
+  free(entry->addrs);
+  free(entry);
+  dns_stats.entries--;
+}
+
+static void dns_store_put(const char* key, uv_err_t err, const luv_sockaddr_t* addrs, int naddrs) {
+  uint32_t hash = dns_hash(key);
+  uint64_t ttl  = err.code == UV_OK ? dns_ttl : dns_negative_ttl;
+  luv_dns_entry_t** e;
+  luv_dns_entry_t*  entry;
+
+  uv_mutex_lock(&dns_mutex);
+  if (!ttl) {
+    uv_mutex_unlock(&dns_mutex);
+    return;
+  }
+  e = dns_find(key, hash);
+  if (*e) dns_remove(e);
+  while (dns_stats.entries >= LUV_DNS_MAX) {
+    entry = ngx_queue_data(ngx_queue_head(&dns_lru), luv_dns_entry_t, lru);
+    dns_remove(dns_find(entry->key, entry->hash));
+  }
+
+  entry = (luv_dns_entry_t*)malloc(sizeof(luv_dns_entry_t) + strlen(key));
+  strcpy(entry->key, key);
+  entry->hash    = hash;
+  entry->expires = uv_hrtime() + ttl;
+  entry->err     = err;
+  entry->naddrs  = naddrs;
+  entry->addrs   = NULL;
+  if (naddrs) {
+    entry->addrs = (luv_sockaddr_t*)malloc(naddrs * sizeof(luv_sockaddr_t));
+    memcpy(entry->addrs, addrs, naddrs * sizeof(luv_sockaddr_t));
+  }
+  entry->next = dns_store[hash % LUV_DNS_BUCKETS];
+  dns_store[hash % LUV_DNS_BUCKETS] = entry;
+  ngx_queue_insert_tail(&dns_lru, &entry->lru);
+  dns_stats.entries++;
+  uv_mutex_unlock(&dns_mutex);
+}
+
+/* copy a live entry's answer, returns 0 on a miss */
+static int dns_store_get(const char* key, uv_err_t* err, luv_sockaddr_t** addrs, int* naddrs) {
+  uint32_t hash = dns_hash(key);
+  luv_dns_entry_t** e;
+  int hit = 0;
+
+  uv_mutex_lock(&dns_mutex);
+  e = dns_find(key, hash);
+  if (*e && (*e)->expires <= uv_hrtime()) {
+    dns_remove(e);
+  }
+  else if (*e) {
+    *err    = (*e)->err;
+    *naddrs = (*e)->naddrs;
+    *addrs  = NULL;
+    if ((*e)->naddrs) {
+      *addrs = (luv_sockaddr_t*)malloc((*e)->naddrs * sizeof(luv_sockaddr_t));
+      memcpy(*addrs, (*e)->addrs, (*e)->naddrs * sizeof(luv_sockaddr_t));
+    }
+    hit = 1;
+  }
+  if (hit) dns_stats.hits++; else dns_stats.misses++;
+  uv_mutex_unlock(&dns_mutex);
+  return hit;
+}
+
+static void dns_wake(ngx_queue_t* waiters, uv_err_t err, const luv_sockaddr_t* addrs, int naddrs) {
+  while (!ngx_queue_empty(waiters)) {
+    ngx_queue_t* q = ngx_queue_head(waiters);
+    luv_dns_waiter_t* w = ngx_queue_data(q, luv_dns_waiter_t, queue);
+    ngx_queue_remove(q);
+    w->cb(w, err, addrs, naddrs);
+  }
+}
+
+static void dns_getaddrinfo_cb(uv_getaddrinfo_t* req, int status, struct addrinfo* res) {
+  luv_dns_req_t*  dr = container_of(req, luv_dns_req_t, req);
+  luv_sockaddr_t* addrs = NULL;
+  struct addrinfo* ai;
+  uv_err_t err;
+  int n = 0;
+
+  memset(&err, 0, sizeof(err));
+  if (status) {
+    err = uv_last_error(req->loop);
+  }
+  else {
+    for (ai = res; ai; ai = ai->ai_next) n++;
+    addrs = (luv_sockaddr_t*)calloc(n ? n : 1, sizeof(luv_sockaddr_t));
+    n = 0;
+    for (ai = res; ai; ai = ai->ai_next) {
+      if (ai->ai_family == PF_INET) {
+        addrs[n++].in4 = *(struct sockaddr_in*)ai->ai_addr;
+      }
+      else if (ai->ai_family == PF_INET6) {
+        addrs[n++].in6 = *(struct sockaddr_in6*)ai->ai_addr;
+      }
+    }
+    if (!n) err.code = UV_ENOENT;
+    uv_freeaddrinfo(res);
+  }
+
+  dns_store_put(dr->key, err, addrs, n);
+
+  /* waiters may start new lookups of the same name */
+  ngx_queue_remove(&dr->link);
+  dns_wake(&dr->waiters, err, addrs, n);
+  free(addrs);
+  free(dr);
+}
+
+/* resolve through the cache. Returns 1 if `w' was called back already,
+** from the cache or because the request couldn't be started, and 0 if
+** it will be once the lookup completes */
+int luvL_dns_lookup(uv_loop_t* loop, const char* node, const char* service,
+                    const struct addrinfo* hints, luv_dns_waiter_t* w) {
+  luv_thread_t*   thread = (luv_thread_t*)loop->data;
+  char*           key    = dns_key(node, service, hints);
+  luv_sockaddr_t* addrs;
+  luv_dns_req_t*  dr;
+  ngx_queue_t*    q;
+  uv_err_t err;
+  int naddrs;
+
+  if (dns_store_get(key, &err, &addrs, &naddrs)) {
+    free(key);
+    w->cb(w, err, addrs, naddrs);
+    free(addrs);
+    return 1;
+  }
+
+  ngx_queue_foreach(q, &thread->resolving) {
+    dr = ngx_queue_data(q, luv_dns_req_t, link);
+    if (!strcmp(dr->key, key)) {
+      free(key);
+      uv_mutex_lock(&dns_mutex);
+      dns_stats.coalesced++;
+      uv_mutex_unlock(&dns_mutex);
+      ngx_queue_insert_tail(&dr->waiters, &w->queue);
+      return 0;
+    }
+  }
+
+  dr = (luv_dns_req_t*)malloc(sizeof(luv_dns_req_t) + strlen(key));
+  strcpy(dr->key, key);
+  free(key);
+  ngx_queue_init(&dr->waiters);
+  if (uv_getaddrinfo(loop, &dr->req, dns_getaddrinfo_cb, node, service, hints)) {
+    err = uv_last_error(loop);
+    free(dr);
+    w->cb(w, err, NULL, 0);
+    return 1;
+  }
+  ngx_queue_insert_tail(&thread->resolving, &dr->link);
+  ngx_queue_insert_tail(&dr->waiters, &w->queue);
+  return 0;
+}
+
+/* TTLs in seconds, 0 disables caching */
+void luvL_dns_ttl(double ttl, double negative_ttl) {
+  uv_mutex_lock(&dns_mutex);
+  dns_ttl          = (uint64_t)(ttl * 1e9);
+  dns_negative_ttl = (uint64_t)(negative_ttl * 1e9);
+  uv_mutex_unlock(&dns_mutex);
+}
+
+void luvL_dns_flush(void) {
+  int i;
+  uv_mutex_lock(&dns_mutex);
+  for (i = 0; i < LUV_DNS_BUCKETS; i++) {
+    while (dns_store[i]) dns_remove(&dns_store[i]);
+  }
+  uv_mutex_unlock(&dns_mutex);
+}
+
+void luvL_dns_stats(luv_dns_stats_t* stats) {
+  uv_mutex_lock(&dns_mutex);
+  *stats = dns_stats;
+  uv_mutex_unlock(&dns_mutex);
+}
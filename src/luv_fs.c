@@ -78,6 +78,10 @@ static void luv_push_stats_table(lua_State* L, struct stat* s) {
 
 static void luv_fs_result(lua_State* L, uv_fs_t* req) {
   TRACE("enter fs result...\n");
+  if (req->fs_type == UV_FS_READ && !req->data) {
+    /* read_into, the buffer was kept on the stack until now */
+    lua_settop(L, 0);
+  }
   if (req->result == -1) {
     lua_pushnil(L);
     lua_pushinteger(L, (uv_err_code)req->errorno);
@@ -112,6 +116,7 @@ static void luv_fs_result(lua_State* L, uv_fs_t* req) {
 
       case UV_FS_READ:
         lua_pushinteger(L, req->result);
+        if (!req->data) break; /* read_into */
         lua_pushlstring(L, (const char*)req->data, req->result);
         free(req->data);
         req->data = NULL;
@@ -393,6 +398,17 @@ static int luv_file_read(lua_State *L) {
   LUV_FS_CALL(L, read, buf, self->h.file, buf, len, ofs);
 }
 
+/* file:read_into(buf, [offset]), read up to #buf bytes straight into
+** the buffer, returns the count */
+static int luv_file_read_into(lua_State *L) {
+  luv_object_t* self = (luv_object_t*)luaL_checkudata(L, 1, LUV_FILE_T);
+  luv_buffer_t* buf  = (luv_buffer_t*)luaL_checkudata(L, 2, LUV_BUFFER_T);
+  int64_t ofs = luaL_optint(L, 3, -1);
+
+  lua_settop(L, 2);
+  LUV_FS_CALL(L, read, NULL, self->h.file, buf->data, buf->size, ofs);
+}
+
 static int luv_file_write(lua_State *L) {
   luv_object_t* self = (luv_object_t*)luaL_checkudata(L, 1, LUV_FILE_T);
 
@@ -446,6 +462,7 @@ luaL_Reg luv_fs_funcs[] = {
 
 luaL_Reg luv_file_meths[] = {
   {"read",      luv_file_read},
+  {"read_into", luv_file_read_into},
   {"write",     luv_file_write},
   {"close",     luv_file_close},
   {"stat",      luv_file_stat},
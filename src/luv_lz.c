@@ -0,0 +1,156 @@
+#include "luv.h"
+
+/* A small LZ77 block compressor in the spirit of LZ4. A block is a
+** sequence of (token, literals, match) triples, where the token holds
+** the literal length in the high nibble and the match length minus
+** LZ_MIN_MATCH in the low one, each extended with 255-runs when they
+** overflow. Matches are a 16 bit little endian offset. The last sequence
+** has literals only. */
+
+#define LZ_HASH_LOG   12
+#define LZ_HASH_SIZE  (1 << LZ_HASH_LOG)
+#define LZ_MIN_MATCH  4
+#define LZ_LAST_LITS  5
+#define LZ_MAX_OFFSET 65535
+
+static uint32_t lz_read32(const uint8_t* p) {
+  uint32_t v;
+  memcpy(&v, p, sizeof v);
+  return v;
+}
+
+static uint32_t lz_hash(uint32_t v) {
+  return (v * 2654435761U) >> (32 - LZ_HASH_LOG);
+}
+
+/* write a 255-run length extension, returns NULL on overflow */
+static uint8_t* lz_put_length(uint8_t* op, uint8_t* oend, size_t len) {
+  for (; len >= 255; len -= 255) {
+    if (op >= oend) return NULL;
+    *op++ = 255;
+  }
+  if (op >= oend) return NULL;
+  *op++ = (uint8_t)len;
+  return op;
+}
+
+static uint8_t* lz_put_sequence(uint8_t* op, uint8_t* oend,
+  const uint8_t* lit, size_t nlit, size_t offset, size_t mlen) {
+  uint8_t* token = op++;
+  if (op > oend) return NULL;
+
+  *token = (uint8_t)((nlit < 15 ? nlit : 15) << 4);
+  if (nlit >= 15 && !(op = lz_put_length(op, oend, nlit - 15))) return NULL;
+
+  if ((size_t)(oend - op) < nlit) return NULL;
+  memcpy(op, lit, nlit);
+  op += nlit;
+
+  if (mlen) {
+    mlen -= LZ_MIN_MATCH;
+    if (oend - op < 2) return NULL;
+    *op++ = (uint8_t)(offset & 0xff);
+    *op++ = (uint8_t)(offset >> 8);
+    *token |= (uint8_t)(mlen < 15 ? mlen : 15);
+    if (mlen >= 15 && !(op = lz_put_length(op, oend, mlen - 15))) return NULL;
+  }
+  return op;
+}
+
+/* compress `len' bytes from `src' into at most `cap' bytes at `dst'.
+** Returns the compressed size, or 0 if it doesn't fit */
+size_t luvL_lz_compress(const uint8_t* src, size_t len, uint8_t* dst, size_t cap) {
+  uint32_t table[LZ_HASH_SIZE];
+
+  const uint8_t* ip     = src;
+  const uint8_t* anchor = src;
+  const uint8_t* iend   = src + len;
+
+  uint8_t* op   = dst;
+  uint8_t* oend = dst + cap;
+
+  memset(table, 0, sizeof table);
+
+  if (len > LZ_MIN_MATCH + LZ_LAST_LITS) {
+    const uint8_t* mlimit = iend - LZ_LAST_LITS;
+    while (ip + LZ_MIN_MATCH <= mlimit) {
+      uint32_t seq = lz_read32(ip);
+      uint32_t h   = lz_hash(seq);
+      const uint8_t* ref = src + table[h];
+      table[h] = (uint32_t)(ip - src);
+
+      if (ref < ip && ip - ref <= LZ_MAX_OFFSET && lz_read32(ref) == seq) {
+        size_t mlen = LZ_MIN_MATCH;
+        while (ip + mlen < mlimit && ref[mlen] == ip[mlen]) mlen++;
+
+        op = lz_put_sequence(op, oend, anchor, ip - anchor, ip - ref, mlen);
+        if (!op) return 0;
+
+        ip += mlen;
+        anchor = ip;
+      }
+      else {
+        ip++;
+      }
+    }
+  }
+
+  op = lz_put_sequence(op, oend, anchor, iend - anchor, 0, 0);
+  if (!op) return 0;
+  return op - dst;
+}
+
+/* decompress exactly `rawlen' bytes, checking all bounds.
+** Returns 0 on success, -1 if the input is corrupt */
+int luvL_lz_decompress(const uint8_t* src, size_t len, uint8_t* dst, size_t rawlen) {
+  const uint8_t* ip   = src;
+  const uint8_t* iend = src + len;
+  uint8_t* op   = dst;
+  uint8_t* oend = dst + rawlen;
+
+  while (ip < iend) {
+    uint8_t token = *ip++;
+    size_t  nlit  = token >> 4;
+    size_t  mlen  = token & 15;
+    size_t  offset;
+
+    if (nlit == 15) {
+      uint8_t b;
+      do {
+        if (ip >= iend) return -1;
+        b = *ip++;
+        nlit += b;
+      } while (b == 255);
+    }
+    if ((size_t)(iend - ip) < nlit || (size_t)(oend - op) < nlit) return -1;
+    memcpy(op, ip, nlit);
+    ip += nlit;
+    op += nlit;
+
+    if (ip == iend) break; /* last sequence */
+
+    if (iend - ip < 2) return -1;
+    offset = ip[0] | (ip[1] << 8);
+    ip += 2;
+    if (offset == 0 || offset > (size_t)(op - dst)) return -1;
+
+    if (mlen == 15) {
+      uint8_t b;
+      do {
+        if (ip >= iend) return -1;
+        b = *ip++;
+        mlen += b;
+      } while (b == 255);
+    }
+    mlen += LZ_MIN_MATCH;
+    if ((size_t)(oend - op) < mlen) return -1;
+
+    /* byte wise, matches may overlap their own output */
+    {
+      const uint8_t* ref = op - offset;
+      while (mlen--) *op++ = *ref++;
+    }
+  }
+
+  return op == oend ? 0 : -1;
+}
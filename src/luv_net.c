@@ -1,6 +1,19 @@
+#ifdef __linux__
+#define _GNU_SOURCE /* recvmmsg */
+#endif
+
 #include "luv.h"
 #include <string.h>
 
+#ifndef WIN32
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#endif
+
 static int luv_new_tcp(lua_State* L) {
   luv_state_t*  curr = luvL_state_self(L);
   luv_object_t* self = (luv_object_t*)lua_newuserdata(L, sizeof(luv_object_t));
@@ -13,34 +26,84 @@ static int luv_new_tcp(lua_State* L) {
   return 1;
 }
 
-static void _getaddrinfo_cb(uv_getaddrinfo_t* req, int s, struct addrinfo* ai) {
-  luv_state_t* curr = container_of(req, luv_state_t, req);
+/* push the host and port of `peer' */
+static void _push_addr(lua_State* L, struct sockaddr* peer) {
   char host[INET6_ADDRSTRLEN];
   int  port = 0;
-
-  if (ai->ai_family == PF_INET) {
-    struct sockaddr_in* addr = (struct sockaddr_in*)ai->ai_addr;
+  host[0] = '\0';
+  if (peer->sa_family == PF_INET) {
+    struct sockaddr_in* addr = (struct sockaddr_in*)peer;
     uv_ip4_name(addr, host, INET6_ADDRSTRLEN);
-    port = addr->sin_port;
+    port = ntohs(addr->sin_port);
   }
-  else if (ai->ai_family == PF_INET6) {
-    struct sockaddr_in6* addr = (struct sockaddr_in6*)ai->ai_addr;
+  else if (peer->sa_family == PF_INET6) {
+    struct sockaddr_in6* addr = (struct sockaddr_in6*)peer;
     uv_ip6_name(addr, host, INET6_ADDRSTRLEN);
-    port = addr->sin6_port;
+    port = ntohs(addr->sin6_port);
+  }
+  lua_pushstring(L, host);
+  lua_pushinteger(L, port);
+}
+
+/* parse an IPv4 or IPv6 address, returns -1 if `host' isn't one */
+static int _sockaddr_parse(const char* host, int port, luv_sockaddr_t* addr) {
+  char buf[sizeof(struct in6_addr)];
+  memset(addr, 0, sizeof(luv_sockaddr_t));
+  if (strchr(host, ':')) {
+    addr->in6 = uv_ip6_addr(host, port);
+    return uv_inet_pton(AF_INET6, host, buf).code == UV_OK ? 0 : -1;
   }
-  lua_settop(curr->L, 0);
-  lua_pushstring(curr->L, host);
-  lua_pushinteger(curr->L, port);
+  addr->in4 = uv_ip4_addr(host, port);
+  return uv_inet_pton(AF_INET, host, buf).code == UV_OK ? 0 : -1;
+}
 
-  uv_freeaddrinfo(ai);
+static socklen_t _sockaddr_len(const luv_sockaddr_t* addr) {
+  switch (addr->sa.sa_family) {
+    case PF_INET:  return sizeof(struct sockaddr_in);
+    case PF_INET6: return sizeof(struct sockaddr_in6);
+  }
+  return 0;
+}
 
-  luvL_state_ready(curr);
+#ifndef WIN32
+static int _udp_same_addr(const luv_sockaddr_t* a, const luv_sockaddr_t* b) {
+  if (a->sa.sa_family != b->sa.sa_family) return 0;
+  if (a->sa.sa_family == PF_INET) {
+    return a->in4.sin_port == b->in4.sin_port
+      && a->in4.sin_addr.s_addr == b->in4.sin_addr.s_addr;
+  }
+  return a->sa.sa_family == PF_INET6 && a->in6.sin6_port == b->in6.sin6_port
+    && !memcmp(&a->in6.sin6_addr, &b->in6.sin6_addr, sizeof(struct in6_addr));
+}
+#endif
+
+/* a fiber waiting in getaddrinfo */
+typedef struct luv_dns_lua_s {
+  luv_dns_waiter_t  waiter;
+  luv_state_t*      state;
+  int               suspended;
+} luv_dns_lua_t;
+
+static void _getaddrinfo_cb(luv_dns_waiter_t* w, uv_err_t err, const luv_sockaddr_t* addrs, int naddrs) {
+  luv_dns_lua_t* dl = container_of(w, luv_dns_lua_t, waiter);
+  lua_State* L = dl->state->L;
+
+  lua_settop(L, 0);
+  if (err.code != UV_OK) {
+    lua_pushnil(L);
+    lua_pushfstring(L, "getaddrinfo: %s", uv_strerror(err));
+  }
+  else {
+    _push_addr(L, (struct sockaddr*)&addrs[0].sa);
+  }
+  if (dl->suspended) luvL_state_ready(dl->state);
+  free(dl);
 }
 
 static int luv_getaddrinfo(lua_State* L) {
   luv_state_t* curr = luvL_state_self(L);
   uv_loop_t*   loop = luvL_event_loop(L);
-  uv_getaddrinfo_t* req = &curr->req.getaddrinfo;
+  luv_dns_lua_t* dl;
 
   const char* node      = NULL;
   const char* service   = NULL;
@@ -56,6 +119,7 @@ static int luv_getaddrinfo(lua_State* L) {
     return luaL_error(L, "getaddrinfo: provide either node or service");
   }
 
+  memset(&hints, 0, sizeof(hints));
   hints.ai_family   = PF_INET;
   hints.ai_socktype = SOCK_STREAM;
   hints.ai_protocol = IPPROTO_TCP;
@@ -68,9 +132,12 @@ static int luv_getaddrinfo(lua_State* L) {
       if (strcmp(s, "INET") == 0) {
         hints.ai_family = PF_INET;
       }
-      else if (strcmp(s, "INET6")) {
+      else if (strcmp(s, "INET6") == 0) {
         hints.ai_family = PF_INET6;
       }
+      else if (strcmp(s, "UNSPEC") == 0) {
+        hints.ai_family = PF_UNSPEC;
+      }
       else {
         return luaL_error(L, "unsupported family: %s", s);
       }
@@ -80,10 +147,10 @@ static int luv_getaddrinfo(lua_State* L) {
     lua_getfield(L, 3, "socktype");
     if (!lua_isnil(L, -1)) {
       const char* s = lua_tostring(L, -1);
-      if (strcmp(s, "STREAM")) {
+      if (strcmp(s, "STREAM") == 0) {
         hints.ai_socktype = SOCK_STREAM;
       }
-      else if (strcmp(s, "DGRAM")) {
+      else if (strcmp(s, "DGRAM") == 0) {
         hints.ai_socktype = SOCK_DGRAM;
       }
       else {
@@ -95,10 +162,10 @@ static int luv_getaddrinfo(lua_State* L) {
     lua_getfield(L, 3, "protocol");
     if (!lua_isnil(L, -1)) {
       const char* s = lua_tostring(L, -1);
-      if (strcmp(s, "TCP")) {
+      if (strcmp(s, "TCP") == 0) {
         hints.ai_protocol = IPPROTO_TCP;
       }
-      else if (strcmp(s, "UDP")) {
+      else if (strcmp(s, "UDP") == 0) {
         hints.ai_protocol = IPPROTO_UDP;
       }
       else {
@@ -108,55 +175,415 @@ static int luv_getaddrinfo(lua_State* L) {
     lua_pop(L, 1);
   }
 
-  int rv = uv_getaddrinfo(loop, req, _getaddrinfo_cb, node, service, &hints);
-  if (rv) {
-    uv_err_t err = uv_last_error(loop);
-    return luaL_error(L, uv_strerror(err));
+  dl = (luv_dns_lua_t*)malloc(sizeof(luv_dns_lua_t));
+  dl->waiter.cb = _getaddrinfo_cb;
+  dl->state     = curr;
+  dl->suspended = 0;
+  if (luvL_dns_lookup(loop, node, service, &hints, &dl->waiter)) {
+    /* answered from the cache */
+    return lua_gettop(L);
   }
-
+  dl->suspended = 1;
   return luvL_state_suspend(curr);
 }
 
+/* luv.net.dns_ttl(ttl, [negative_ttl]), how long lookups are cached, in
+** seconds. 0 disables caching */
+static int luv_net_dns_ttl(lua_State* L) {
+  lua_Number ttl = luaL_checknumber(L, 1);
+  lua_Number neg = luaL_optnumber(L, 2, LUV_DNS_NEGATIVE_TTL);
+  luaL_argcheck(L, ttl >= 0, 1, "must not be negative");
+  luaL_argcheck(L, neg >= 0, 2, "must not be negative");
+  luvL_dns_ttl(ttl, neg);
+  return 0;
+}
+
+static int luv_net_dns_flush(lua_State* L) {
+  luvL_dns_flush();
+  return 0;
+}
+
+static int luv_net_dns_stats(lua_State* L) {
+  luv_dns_stats_t stats;
+  luvL_dns_stats(&stats);
+  lua_createtable(L, 0, 4);
+  lua_pushnumber(L, (lua_Number)stats.hits);
+  lua_setfield(L, -2, "hits");
+  lua_pushnumber(L, (lua_Number)stats.misses);
+  lua_setfield(L, -2, "misses");
+  lua_pushnumber(L, (lua_Number)stats.coalesced);
+  lua_setfield(L, -2, "coalesced");
+  lua_pushnumber(L, (lua_Number)stats.entries);
+  lua_setfield(L, -2, "entries");
+  return 1;
+}
+
+#ifdef SO_REUSEPORT
+/* libuv creates the socket in uv_tcp_bind, too late to set options on
+** it, so make our own and hand it over for uv_tcp_bind to bind. Returns
+** 0, or an errno */
+static int _tcp_reuseport(luv_object_t* self, int family) {
+  int on = 1, rv = 0;
+  int fd = socket(family, SOCK_STREAM, 0);
+  if (fd < 0) return errno;
+  if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on))
+   || setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on))) {
+    rv = errno;
+    close(fd);
+    return rv;
+  }
+  if (uv_tcp_open(&self->h.tcp, fd)) {
+    close(fd);
+    return EINVAL;
+  }
+  return 0;
+}
+#endif
+
+/* tcp:bind(host, port, [opts]), host may be IPv4 or IPv6. With
+** opts.reuseport any number of sockets, in any thread, can bind the
+** same address and the kernel spreads connections between them */
 static int luv_tcp_bind(lua_State* L) {
   luv_object_t *self = (luv_object_t*)luaL_checkudata(L, 1, LUV_NET_TCP_T);
 
-  struct sockaddr_in addr;
+  luv_sockaddr_t addr;
   const char* host;
-  int port, rv;
+  int port, rv, reuseport = 0;
 
   host = luaL_checkstring(L, 2);
   port = luaL_checkint(L, 3);
-  addr = uv_ip4_addr(host, port);
+  if (_sockaddr_parse(host, port, &addr)) {
+    lua_pushinteger(L, -1);
+    lua_pushliteral(L, "bind: bad address");
+    return 2;
+  }
+
+  if (lua_istable(L, 4)) {
+    lua_getfield(L, 4, "reuseport");
+    reuseport = lua_toboolean(L, -1);
+    lua_pop(L, 1);
+  }
+
+  if (reuseport) {
+#ifdef SO_REUSEPORT
+    rv = _tcp_reuseport(self, addr.sa.sa_family);
+    if (rv) {
+      return luaL_error(L, "bind: %s", strerror(rv));
+    }
+#else
+    return luaL_error(L, "bind: reuseport is not supported on this platform");
+#endif
+  }
 
-  rv = uv_tcp_bind(&self->h.tcp, addr);
+  if (addr.sa.sa_family == PF_INET6) {
+    rv = uv_tcp_bind6(&self->h.tcp, addr.in6);
+  }
+  else {
+    rv = uv_tcp_bind(&self->h.tcp, addr.in4);
+  }
   lua_pushinteger(L, rv);
 
   return 1;
 }
 
-static int luv_tcp_connect(lua_State *L) {
-  luv_object_t* self = (luv_object_t*)luaL_checkudata(L, 1, LUV_NET_TCP_T);
-  luv_state_t*  curr = luvL_state_self(L);
+/* Connecting to a name races its addresses (RFC 8305, "Happy Eyeballs").
+** Candidates alternate between address families, starting with the one
+** getaddrinfo preferred, and each gets LUV_CONNECT_DELAY ms before the
+** next is started alongside it, or none if it fails sooner. Attempts use
+** their own sockets; the first to connect is handed to the tcp object and
+** the others are closed. A tcp object which is already bound has its
+** socket, so connects to the first address of the same family only. */
+
+#define LUV_CONNECT_DELAY 250
+
+typedef struct luv_connect_s luv_connect_t;
+
+/* called once, `err' is NULL on success */
+typedef void (*luv_connect_done_cb)(luv_connect_t* c, const char* err);
+
+typedef struct luv_connect_attempt_s {
+  uv_tcp_t        tcp;
+  uv_connect_t    req;
+  luv_connect_t*  c;
+  int             closing;
+} luv_connect_attempt_t;
+
+struct luv_connect_s {
+  luv_dns_waiter_t        waiter;
+  uv_timer_t              timer;
+  uv_connect_t            req;      /* connecting `self' directly */
+  luv_object_t*           self;
+  luv_state_t*            state;
+  luv_connect_done_cb     cb;
+  void*                   data;
+  luv_sockaddr_t*         addrs;
+  luv_connect_attempt_t*  attempts;
+  int                     naddrs;
+  int                     next;     /* next address to try */
+  int                     inflight; /* attempts waiting on the kernel */
+  int                     handles;  /* open timer and attempt handles */
+  int                     suspended;
+  int                     done;
+  uv_err_t                err;      /* of the last failed attempt */
+};
 
-  struct sockaddr_in addr;
-  const char* host;
-  int port, rv;
+static luv_connect_t* _connect_new(luv_object_t* self, luv_state_t* state, luv_connect_done_cb cb, void* data) {
+  luv_connect_t* c = (luv_connect_t*)calloc(1, sizeof(luv_connect_t));
+  c->self  = self;
+  c->state = state;
+  c->cb    = cb;
+  c->data  = data;
+  c->err.code = UV_ECONNREFUSED;
+  /* the timer outlives the callback, so `c' can be tested after
+  ** _connect_start even if that called back already */
+  uv_timer_init(state->loop, &c->timer);
+  c->timer.data = c;
+  c->handles = 1;
+  return c;
+}
 
-  host = luaL_checkstring(L, 2);
-  port = luaL_checkint(L, 3);
-  addr = uv_ip4_addr(host, port);
+static void _connect_handle_closed(luv_connect_t* c) {
+  if (--c->handles == 0) {
+    free(c->addrs);
+    free(c->attempts);
+    free(c);
+  }
+}
 
-  lua_settop(L, 2);
+static void _connect_timer_close_cb(uv_handle_t* handle) {
+  _connect_handle_closed((luv_connect_t*)handle->data);
+}
+
+static void _connect_attempt_close_cb(uv_handle_t* handle) {
+  luv_connect_attempt_t* a = (luv_connect_attempt_t*)handle->data;
+  _connect_handle_closed(a->c);
+}
+
+static void _connect_attempt_close(luv_connect_attempt_t* a) {
+  if (!a->closing) {
+    a->closing = 1;
+    uv_close((uv_handle_t*)&a->tcp, _connect_attempt_close_cb);
+  }
+}
+
+static void _connect_finish(luv_connect_t* c, const char* err) {
+  int i;
+  if (c->done) return;
+  c->done = 1;
+  uv_timer_stop(&c->timer);
+  uv_close((uv_handle_t*)&c->timer, _connect_timer_close_cb);
+  for (i = 0; i < c->next; i++) {
+    if (c->attempts) _connect_attempt_close(&c->attempts[i]);
+  }
+  c->cb(c, err);
+}
+
+#ifndef WIN32
+static void _connect_next(luv_connect_t* c);
+
+static void _connect_timer_cb(uv_timer_t* handle, int status) {
+  _connect_next((luv_connect_t*)handle->data);
+}
+
+static void _connect_attempt_cb(uv_connect_t* req, int status) {
+  luv_connect_attempt_t* a = container_of(req, luv_connect_attempt_t, req);
+  luv_connect_t* c = a->c;
+  int fd;
+
+  c->inflight--;
+  if (c->done) return;
+
+  if (status) {
+    c->err = uv_last_error(a->tcp.loop);
+    _connect_attempt_close(a);
+    /* don't wait out the delay for the next one */
+    uv_timer_stop(&c->timer);
+    _connect_next(c);
+    return;
+  }
+
+  /* the winner's socket moves to `self', its handle is closed with the
+  ** losers' */
+  fd = dup(a->tcp.fd);
+  if (fd < 0) {
+    _connect_finish(c, strerror(errno));
+    return;
+  }
+  if (uv_tcp_open(&c->self->h.tcp, fd)) {
+    close(fd);
+    _connect_finish(c, uv_strerror(uv_last_error(a->tcp.loop)));
+    return;
+  }
+  _connect_finish(c, NULL);
+}
+
+/* start the next attempt, and a timer for the one after */
+static void _connect_next(luv_connect_t* c) {
+  uv_loop_t* loop = c->state->loop;
+  while (c->next < c->naddrs) {
+    luv_connect_attempt_t* a = &c->attempts[c->next];
+    luv_sockaddr_t* addr = &c->addrs[c->next];
+    int rv;
+
+    c->next++;
+    uv_tcp_init(loop, &a->tcp);
+    a->tcp.data = a;
+    a->c = c;
+    c->handles++;
+
+    if (addr->sa.sa_family == PF_INET6) {
+      rv = uv_tcp_connect6(&a->req, &a->tcp, addr->in6, _connect_attempt_cb);
+    }
+    else {
+      rv = uv_tcp_connect(&a->req, &a->tcp, addr->in4, _connect_attempt_cb);
+    }
+    if (rv) {
+      c->err = uv_last_error(loop);
+      _connect_attempt_close(a);
+      continue;
+    }
+    c->inflight++;
+    if (c->next < c->naddrs) {
+      uv_timer_start(&c->timer, _connect_timer_cb, LUV_CONNECT_DELAY, 0);
+    }
+    return;
+  }
+  if (!c->inflight) {
+    _connect_finish(c, uv_strerror(c->err));
+  }
+}
+#endif
+
+static void _connect_direct_cb(uv_connect_t* req, int status) {
+  luv_connect_t* c = container_of(req, luv_connect_t, req);
+  if (status) {
+    _connect_finish(c, uv_strerror(uv_last_error(req->handle->loop)));
+    return;
+  }
+  _connect_finish(c, NULL);
+}
 
-  rv = uv_tcp_connect(&curr->req.connect, &self->h.tcp, addr, luvL_connect_cb);
+/* connect `self' itself to the first address in the family of its socket */
+static void _connect_direct(luv_connect_t* c, const luv_sockaddr_t* addrs, int naddrs) {
+  uv_tcp_t* tcp = &c->self->h.tcp;
+  const luv_sockaddr_t* addr = &addrs[0];
+  struct sockaddr_storage name;
+  int i, len = sizeof(name), rv;
+
+  if (!uv_tcp_getsockname(tcp, (struct sockaddr*)&name, &len)) {
+    for (i = 0; i < naddrs; i++) {
+      if (addrs[i].sa.sa_family == name.ss_family) {
+        addr = &addrs[i];
+        break;
+      }
+    }
+  }
+  if (addr->sa.sa_family == PF_INET6) {
+    rv = uv_tcp_connect6(&c->req, tcp, addr->in6, _connect_direct_cb);
+  }
+  else {
+    rv = uv_tcp_connect(&c->req, tcp, addr->in4, _connect_direct_cb);
+  }
   if (rv) {
-    uv_err_t err = uv_last_error(self->h.handle.loop);
+    _connect_finish(c, uv_strerror(uv_last_error(tcp->loop)));
+  }
+}
+
+static void _connect_resolved(luv_dns_waiter_t* w, uv_err_t err, const luv_sockaddr_t* addrs, int naddrs) {
+  luv_connect_t* c = container_of(w, luv_connect_t, waiter);
+  int i, n4, n6, family;
+
+  if (err.code != UV_OK) {
+    _connect_finish(c, uv_strerror(err));
+    return;
+  }
+
+#ifdef WIN32
+  _connect_direct(c, addrs, naddrs);
+#else
+  if (c->self->h.stream.fd >= 0) {
+    _connect_direct(c, addrs, naddrs);
+    return;
+  }
+
+  /* interleave the families, keeping the resolver's order within each */
+  c->addrs    = (luv_sockaddr_t*)malloc(naddrs * sizeof(luv_sockaddr_t));
+  c->attempts = (luv_connect_attempt_t*)calloc(naddrs, sizeof(luv_connect_attempt_t));
+  c->naddrs   = naddrs;
+  family = addrs[0].sa.sa_family;
+  for (i = 0, n4 = 0, n6 = 0; i < naddrs; i++) {
+    int* k = family == PF_INET6 ? &n6 : &n4;
+    while (*k < naddrs && addrs[*k].sa.sa_family != family) (*k)++;
+    if (*k == naddrs) {
+      /* this family ran out, the rest are the other */
+      family = family == PF_INET6 ? PF_INET : PF_INET6;
+      k = family == PF_INET6 ? &n6 : &n4;
+      while (addrs[*k].sa.sa_family != family) (*k)++;
+    }
+    c->addrs[i] = addrs[(*k)++];
+    family = family == PF_INET6 ? PF_INET : PF_INET6;
+  }
+  _connect_next(c);
+#endif
+}
+
+/* connect `c->self' to `host', which may be a name or an address */
+static void _connect_start(luv_connect_t* c, const char* host, const char* service) {
+  struct addrinfo hints;
+  luv_sockaddr_t  addr;
+  char buf[sizeof(struct in6_addr)];
+
+  if (uv_inet_pton(AF_INET, host, buf).code == UV_OK
+   || uv_inet_pton(AF_INET6, host, buf).code == UV_OK) {
+    uv_err_t err;
+    memset(&err, 0, sizeof(err));
+    _sockaddr_parse(host, atoi(service), &addr);
+    _connect_resolved(&c->waiter, err, &addr, 1);
+    return;
+  }
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family   = PF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_protocol = IPPROTO_TCP;
+  c->waiter.cb = _connect_resolved;
+  luvL_dns_lookup(c->state->loop, host, service, &hints, &c->waiter);
+}
+
+static void _tcp_connect_done(luv_connect_t* c, const char* err) {
+  lua_State* L = c->state->L;
+  if (err) {
     lua_settop(L, 0);
     lua_pushnil(L);
-    lua_pushstring(L, uv_strerror(err));
-    return 2;
+    lua_pushfstring(L, "connect: %s", err);
+  }
+  else {
+    lua_settop(L, 1);
   }
+  if (c->suspended) {
+    luvL_state_ready(c->state);
+  }
+}
+
+/* tcp:connect(host, port), host is a name or an IPv4 or IPv6 address.
+** Returns the tcp object, or nil and an error */
+static int luv_tcp_connect(lua_State *L) {
+  luv_object_t* self = (luv_object_t*)luaL_checkudata(L, 1, LUV_NET_TCP_T);
+  luv_state_t*  curr = luvL_state_self(L);
+  luv_connect_t* c;
 
+  const char* host;
+  char service[16];
+
+  host = luaL_checkstring(L, 2);
+  snprintf(service, sizeof(service), "%d", luaL_checkint(L, 3));
+
+  c = _connect_new(self, curr, _tcp_connect_done, NULL);
+  _connect_start(c, host, service);
+  if (c->done) {
+    return lua_gettop(L);
+  }
+  c->suspended = 1;
   return luvL_state_suspend(curr);
 }
 
@@ -322,46 +749,605 @@ static int luv_udp_send(lua_State* L) {
   return luvL_state_suspend(curr);
 }
 
+static luv_udp_io_t* _udp_io(luv_object_t* self) {
+  luv_udp_io_t* io = (luv_udp_io_t*)self->data;
+  if (!io) {
+    io = (luv_udp_io_t*)calloc(1, sizeof(luv_udp_io_t));
+    io->object = self;
+    io->size   = LUV_UDP_RING;
+    ngx_queue_init(&io->sendq);
+    self->data = io;
+  }
+  return io;
+}
+
+static void _udp_dequeue(luv_udp_io_t* io) {
+  luvL_pool_release(luvL_pool_self(io->object->h.handle.loop), io->ring[io->head].buf);
+  io->head = (io->head + 1) % io->size;
+  io->count--;
+}
+
+/* release the queued datagrams, while the socket is still alive */
+static void _udp_io_clear(luv_udp_io_t* io) {
+  while (io->count) _udp_dequeue(io);
+  free(io->ring);
+  free(io->scratch);
+  io->ring    = NULL;
+  io->scratch = NULL;
+}
+
+/* queue a datagram, or drop it if the ring is full */
+static void _udp_enqueue(luv_udp_io_t* io, const char* data, size_t len, struct sockaddr* peer) {
+  luv_dgram_t* d;
+  io->received++;
+  if (io->count >= io->size) {
+    io->dropped++;
+    return;
+  }
+  if (!io->ring) {
+    io->ring = (luv_dgram_t*)malloc(io->size * sizeof(luv_dgram_t));
+  }
+  d = &io->ring[(io->head + io->count) % io->size];
+  d->buf = luvL_pool_alloc(luvL_pool_self(io->object->h.handle.loop), len ? len : 1);
+  d->len = len;
+  memcpy(d->buf.base, data, len);
+  memset(&d->peer, 0, sizeof(d->peer));
+  if (peer->sa_family == PF_INET6) {
+    d->peer.in6 = *(struct sockaddr_in6*)peer;
+  }
+  else if (peer->sa_family == PF_INET) {
+    d->peer.in4 = *(struct sockaddr_in*)peer;
+  }
+  io->count++;
+}
+
+/* push queued datagrams for a receiver whose arguments are on `L',
+** [ self ] for recv, [ self, buf ] for recv_into and [ self, n ] for
+** recv_many. The ring must not be empty */
+static int _udp_push(lua_State* L, luv_udp_io_t* io) {
+  luv_buffer_t* into = luvL_buffer_test(L, 2);
+  luv_dgram_t*  d;
+
+  if (lua_type(L, 2) == LUA_TNUMBER) {
+    size_t i, n = (size_t)lua_tointeger(L, 2);
+    if (n > io->count) n = io->count;
+    lua_settop(L, 0);
+    lua_createtable(L, n, 0);
+    for (i = 1; i <= n; i++) {
+      d = &io->ring[io->head];
+      lua_createtable(L, 3, 0);
+      lua_pushlstring(L, d->buf.base, d->len);
+      lua_rawseti(L, -2, 1);
+      _push_addr(L, &d->peer.sa);
+      lua_rawseti(L, -3, 3);
+      lua_rawseti(L, -2, 2);
+      lua_rawseti(L, -2, i);
+      _udp_dequeue(io);
+    }
+    return 1;
+  }
+
+  d = &io->ring[io->head];
+  if (into) {
+    size_t len = d->len < into->size ? d->len : into->size;
+    memcpy(into->data, d->buf.base, len);
+    lua_settop(L, 0);
+    lua_pushinteger(L, len);
+  }
+  else {
+    lua_settop(L, 0);
+    lua_pushlstring(L, d->buf.base, d->len);
+  }
+  _push_addr(L, &d->peer.sa);
+  /* [ mesg|len, host, port ] */
+  _udp_dequeue(io);
+  return 3;
+}
+
+/* hand queued datagrams to waiting receivers, first come first served */
+static void _udp_wake(luv_udp_io_t* io) {
+  luv_object_t* self = io->object;
+  while (io->count && !ngx_queue_empty(&self->rouse)) {
+    ngx_queue_t* q = ngx_queue_head(&self->rouse);
+    luv_state_t* s = ngx_queue_data(q, luv_state_t, cond);
+    _udp_push(s->L, io);
+    luvL_cond_signal(&self->rouse);
+  }
+}
+
+#ifdef __linux__
+/* read the rest of a burst in batches of datagrams, one syscall each */
+static void _udp_read(luv_udp_io_t* io) {
+  struct mmsghdr  msgs[LUV_UDP_BATCH];
+  struct iovec    iovs[LUV_UDP_BATCH];
+  luv_sockaddr_t  peers[LUV_UDP_BATCH];
+  int i, n;
+
+  if (!io->scratch) {
+    io->scratch = (char*)malloc(LUV_UDP_BATCH * LUV_UDP_SLOT);
+  }
+  memset(msgs, 0, sizeof(msgs));
+  for (i = 0; i < LUV_UDP_BATCH; i++) {
+    iovs[i].iov_base = io->scratch + i * LUV_UDP_SLOT;
+    iovs[i].iov_len  = LUV_UDP_SLOT;
+    msgs[i].msg_hdr.msg_iov     = &iovs[i];
+    msgs[i].msg_hdr.msg_iovlen  = 1;
+    msgs[i].msg_hdr.msg_name    = &peers[i];
+    msgs[i].msg_hdr.msg_namelen = sizeof(luv_sockaddr_t);
+  }
+
+  /* stop at a partial batch, the socket is empty then */
+  do {
+    do {
+      n = recvmmsg(io->object->h.udp.fd, msgs, LUV_UDP_BATCH, MSG_DONTWAIT, NULL);
+    } while (n < 0 && errno == EINTR);
+    if (n <= 0) return;
+
+    io->batches++;
+    for (i = 0; i < n; i++) {
+      _udp_enqueue(io, (char*)iovs[i].iov_base, msgs[i].msg_len, &peers[i].sa);
+      msgs[i].msg_hdr.msg_namelen = sizeof(luv_sockaddr_t);
+    }
+  } while (n == LUV_UDP_BATCH && io->count < io->size);
+}
+#endif
+
+/* whether to keep a datagram from `peer'. Linux sockets are connected in
+** the kernel, elsewhere connect only records the peer */
+static int _udp_wanted(luv_udp_io_t* io, struct sockaddr* peer) {
+#if defined(__linux__) || defined(WIN32)
+  (void)io; (void)peer;
+  return 1;
+#else
+  return !io->connected || _udp_same_addr((luv_sockaddr_t*)peer, &io->peer);
+#endif
+}
+
+/* libuv owns the socket's watcher and reports one datagram at a time,
+** on Linux the rest of the burst is then read with recvmmsg */
 static void _recv_cb(uv_udp_t* handle, ssize_t nread, uv_buf_t buf, struct sockaddr* peer, unsigned flags) {
   luv_object_t* self = container_of(handle, luv_object_t, h);
-  ngx_queue_t* q;
-  luv_state_t* s;
+  luv_udp_io_t* io   = _udp_io(self);
+  if (nread > 0 && _udp_wanted(io, peer)) {
+    io->batches++;
+    _udp_enqueue(io, buf.base, nread, peer);
+  }
+  luvL_pool_release(luvL_pool_self(handle->loop), buf);
+  if (nread > 0) {
+#ifdef __linux__
+    _udp_read(io);
+#endif
+    _udp_wake(io);
+  }
+}
 
-  char host[INET6_ADDRSTRLEN];
-  int  port = 0;
+#ifndef WIN32
+/* sockets need a local address before they have an fd */
+static int _udp_ensure_bound(lua_State* L, luv_object_t* self, int family) {
+  if (self->h.udp.fd < 0) {
+    int rv = family == PF_INET6
+      ? uv_udp_bind6(&self->h.udp, uv_ip6_addr("::", 0), 0)
+      : uv_udp_bind(&self->h.udp, uv_ip4_addr("0.0.0.0", 0), 0);
+    if (rv) {
+      uv_err_t err = uv_last_error(luvL_event_loop(L));
+      return luaL_error(L, "bind: %s", uv_strerror(err));
+    }
+  }
+  return 0;
+}
 
-  ngx_queue_foreach(q, &self->rouse) {
-    s = ngx_queue_data(q, luv_state_t, cond);
+#endif
 
-    lua_settop(s->L, 0);
-    lua_pushlstring(s->L, buf.base, buf.len);
+static int _udp_start(lua_State* L, luv_object_t* self) {
+  if (luvL_object_is_started(self)) return 0;
+  if (uv_udp_recv_start(&self->h.udp, luvL_alloc_cb, _recv_cb)) {
+    uv_err_t err = uv_last_error(luvL_event_loop(L));
+    return luaL_error(L, "recv: %s", uv_strerror(err));
+  }
+  self->flags |= LUV_OSTARTED;
+  return 0;
+}
+
+static int _udp_recv(lua_State* L, luv_object_t* self) {
+  luv_udp_io_t* io = _udp_io(self);
+  _udp_start(L, self);
+  if (io->count) {
+    return _udp_push(L, io);
+  }
+  return luvL_cond_wait(&self->rouse, luvL_state_self(L));
+}
 
-    if (peer->sa_family == PF_INET) {
-      struct sockaddr_in* addr = (struct sockaddr_in*)peer;
-      uv_ip4_name(addr, host, INET6_ADDRSTRLEN);
-      port = addr->sin_port;
+/* udp:recv(), returns the next datagram, its host and port */
+static int luv_udp_recv(lua_State* L) {
+  luv_object_t* self = (luv_object_t*)luaL_checkudata(L, 1, LUV_NET_UDP_T);
+  lua_settop(L, 1);
+  return _udp_recv(L, self);
+}
+
+/* udp:recv_into(buf), like recv but copies the datagram into `buf',
+** truncating it, and returns the length instead of a string */
+static int luv_udp_recv_into(lua_State* L) {
+  luv_object_t* self = (luv_object_t*)luaL_checkudata(L, 1, LUV_NET_UDP_T);
+  luaL_checkudata(L, 2, LUV_BUFFER_T);
+  lua_settop(L, 2);
+  return _udp_recv(L, self);
+}
+
+/* udp:recv_many([n]), returns up to `n' queued datagrams, all of them by
+** default, as a table of { data, host, port }. Waits if there are none */
+static int luv_udp_recv_many(lua_State* L) {
+  luv_object_t* self = (luv_object_t*)luaL_checkudata(L, 1, LUV_NET_UDP_T);
+  lua_Integer n = luaL_optinteger(L, 2, 0);
+  luaL_argcheck(L, n >= 0, 2, "must not be negative");
+  lua_settop(L, 1);
+  lua_pushinteger(L, n ? n : (lua_Integer)_udp_io(self)->size);
+  return _udp_recv(L, self);
+}
+
+/* udp:backlog(size), the number of datagrams which may be queued */
+static int luv_udp_backlog(lua_State* L) {
+  luv_object_t* self = (luv_object_t*)luaL_checkudata(L, 1, LUV_NET_UDP_T);
+  luv_udp_io_t* io   = _udp_io(self);
+  size_t i, size = (size_t)luaL_checkinteger(L, 2);
+  luaL_argcheck(L, size > 0, 2, "must be positive");
+  if (io->ring) {
+    /* keep the oldest datagrams that fit */
+    luv_dgram_t* ring = (luv_dgram_t*)malloc(size * sizeof(luv_dgram_t));
+    for (i = 0; io->count; i++) {
+      if (i < size) {
+        ring[i] = io->ring[io->head];
+        io->head = (io->head + 1) % io->size;
+        io->count--;
+      }
+      else {
+        io->dropped++;
+        _udp_dequeue(io);
+      }
+    }
+    free(io->ring);
+    io->ring  = ring;
+    io->head  = 0;
+    io->count = i < size ? i : size;
+  }
+  io->size = size;
+  return 0;
+}
+
+/* udp:stats(), receive counters */
+static int luv_udp_stats(lua_State* L) {
+  luv_object_t* self = (luv_object_t*)luaL_checkudata(L, 1, LUV_NET_UDP_T);
+  luv_udp_io_t* io   = _udp_io(self);
+  lua_createtable(L, 0, 6);
+  lua_pushnumber(L, (lua_Number)io->received);
+  lua_setfield(L, -2, "received");
+  lua_pushnumber(L, (lua_Number)io->dropped);
+  lua_setfield(L, -2, "dropped");
+  lua_pushnumber(L, (lua_Number)io->batches);
+  lua_setfield(L, -2, "batches");
+  lua_pushnumber(L, (lua_Number)io->count);
+  lua_setfield(L, -2, "queued");
+  lua_pushnumber(L, (lua_Number)io->sent);
+  lua_setfield(L, -2, "sent");
+  lua_pushnumber(L, (lua_Number)io->send_batches);
+  lua_setfield(L, -2, "send_batches");
+  return 1;
+}
+
+#ifndef WIN32
+/* udp:connect(host, port), fix the peer so that send_many can be given
+** plain strings, and only datagrams from it are received */
+static int luv_udp_connect(lua_State* L) {
+  luv_object_t* self = (luv_object_t*)luaL_checkudata(L, 1, LUV_NET_UDP_T);
+  const char*   host = luaL_checkstring(L, 2);
+  int           port = luaL_checkint(L, 3);
+  luv_sockaddr_t addr;
+
+  if (_sockaddr_parse(host, port, &addr)) {
+    return luaL_error(L, "connect: bad address");
+  }
+  _udp_ensure_bound(L, self, addr.sa.sa_family);
+#ifdef __linux__
+  if (connect(self->h.udp.fd, &addr.sa, _sockaddr_len(&addr))) {
+    return luaL_error(L, "connect: %s", strerror(errno));
+  }
+#endif
+  _udp_io(self)->peer      = addr;
+  _udp_io(self)->connected = 1;
+  return 0;
+}
+
+#ifdef __linux__
+#ifndef SOL_UDP
+#define SOL_UDP 17
+#endif
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif
+/* the kernel takes up to 64 segments and one IP packet's worth of payload */
+#define LUV_UDP_GSO_SEGS 64
+#define LUV_UDP_GSO_MAX  65000
+#define LUV_UDP_CMSG     CMSG_SPACE(sizeof(uint16_t))
+typedef struct mmsghdr luv_mmsghdr_t;
+#define _udp_sendmmsg sendmmsg
+#else
+/* sendmmsg as a loop of sendmsg */
+typedef struct luv_mmsghdr_s {
+  struct msghdr msg_hdr;
+  unsigned int  msg_len;
+} luv_mmsghdr_t;
+
+static int _udp_sendmmsg(int fd, luv_mmsghdr_t* msgs, unsigned int n, int flags) {
+  unsigned int i;
+  for (i = 0; i < n; i++) {
+    ssize_t rv = sendmsg(fd, &msgs[i].msg_hdr, flags);
+    if (rv < 0) return i ? (int)i : -1;
+    msgs[i].msg_len = (unsigned int)rv;
+  }
+  return (int)n;
+}
+#endif
+
+/* send as much of `sr' as the socket takes. Returns 1 once it's all sent
+** or failed, 0 if the socket is full */
+static int _udp_send_some(luv_udp_io_t* io, luv_udp_send_t* sr) {
+  luv_mmsghdr_t  hdrs[LUV_UDP_SEND_BATCH];
+  struct iovec   iovs[LUV_UDP_SEND_IOV];
+  size_t         counts[LUV_UDP_SEND_BATCH];
+#ifdef __linux__
+  union {
+    struct cmsghdr align;
+    char buf[LUV_UDP_CMSG];
+  } ctrl[LUV_UDP_SEND_BATCH];
+#endif
+  int fd = io->object->h.udp.fd;
+
+  while (sr->next < sr->n) {
+    size_t k = sr->next, iv = 0;
+    int j, nh = 0, rv, gso = 0;
+
+    memset(hdrs, 0, sizeof(hdrs));
+    while (k < sr->n && nh < LUV_UDP_SEND_BATCH && iv < LUV_UDP_SEND_IOV) {
+      luv_udp_msg_t* m = &sr->msgs[k];
+      struct msghdr* h = &hdrs[nh].msg_hdr;
+      size_t count = 1;
+#ifdef __linux__
+      /* equally sized datagrams to the same peer go as one buffer which
+      ** the kernel cuts into segments, the last one may be shorter */
+      size_t total = m->len;
+      if (!io->nogso && m->len) {
+        while (k + count < sr->n && count < LUV_UDP_GSO_SEGS
+            && iv + count < LUV_UDP_SEND_IOV) {
+          luv_udp_msg_t* next = &sr->msgs[k + count];
+          if (sr->msgs[k + count - 1].len != m->len || !next->len
+              || next->len > m->len || total + next->len > LUV_UDP_GSO_MAX
+              || !_udp_same_addr(&next->addr, &m->addr)) break;
+          total += next->len;
+          count++;
+        }
+      }
+      if (count > 1) {
+        struct cmsghdr* cm;
+        h->msg_control    = ctrl[nh].buf;
+        h->msg_controllen = LUV_UDP_CMSG;
+        cm = CMSG_FIRSTHDR(h);
+        cm->cmsg_level = SOL_UDP;
+        cm->cmsg_type  = UDP_SEGMENT;
+        cm->cmsg_len   = CMSG_LEN(sizeof(uint16_t));
+        *(uint16_t*)CMSG_DATA(cm) = (uint16_t)m->len;
+        gso = 1;
+      }
+#endif
+      h->msg_iov    = &iovs[iv];
+      h->msg_iovlen = count;
+      for (; count; count--, k++) {
+        iovs[iv].iov_base = (void*)sr->msgs[k].data;
+        iovs[iv].iov_len  = sr->msgs[k].len;
+        iv++;
+      }
+      if (m->addr.sa.sa_family != AF_UNSPEC) {
+        h->msg_name    = &m->addr;
+        h->msg_namelen = _sockaddr_len(&m->addr);
+      }
+      counts[nh++] = h->msg_iovlen;
+    }
+
+    rv = _udp_sendmmsg(fd, hdrs, nh, MSG_DONTWAIT);
+    if (rv < 0) {
+      if (errno == EINTR) continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS) return 0;
+      if (gso && (errno == EIO || errno == EINVAL || errno == ENOPROTOOPT
+          || errno == EOPNOTSUPP)) {
+        TRACE("udp segmentation offload refused, disabling it\n");
+        io->nogso = 1;
+        continue;
+      }
+      sr->err = errno;
+      return 1;
     }
-    else if (peer->sa_family == PF_INET6) {
-      struct sockaddr_in6* addr = (struct sockaddr_in6*)peer;
-      uv_ip6_name(addr, host, INET6_ADDRSTRLEN);
-      port = addr->sin6_port;
+    io->send_batches++;
+    for (j = 0; j < rv; j++) {
+      sr->next += counts[j];
+      io->sent += counts[j];
     }
+  }
+  return 1;
+}
 
-    lua_pushstring(s->L, host);
-    lua_pushinteger(s->L, port);
-    /* [ mesg, host, port ] */
+static int _udp_send_result(lua_State* L, luv_udp_send_t* sr) {
+  int nret = 1;
+  lua_settop(L, 0);
+  lua_pushinteger(L, sr->next);
+  if (sr->err) {
+    lua_pushfstring(L, "send_many: %s", strerror(sr->err));
+    nret = 2;
   }
-  luvL_cond_signal(&self->rouse);
+  free(sr->msgs);
+  free(sr);
+  return nret;
 }
 
-static int luv_udp_recv(lua_State* L) {
+static void _udp_wait_cb(uv_udp_send_t* req, int status);
+
+/* the socket is full, so send the next datagram of `sr' with libuv,
+** which waits for the socket on its own watcher, and continue from the
+** callback. Linux takes a destination on a connected socket, elsewhere
+** they aren't connected in the kernel. Returns 1 if that failed */
+static int _udp_wait(luv_udp_io_t* io, luv_udp_send_t* sr) {
+  luv_udp_msg_t*  m   = &sr->msgs[sr->next];
+  luv_sockaddr_t* dst = m->addr.sa.sa_family != AF_UNSPEC ? &m->addr : &io->peer;
+  uv_udp_t*       udp = &io->object->h.udp;
+  uv_buf_t        buf = uv_buf_init((char*)m->data, m->len);
+  int rv = dst->sa.sa_family == PF_INET6
+    ? uv_udp_send6(&sr->req, udp, &buf, 1, dst->in6, _udp_wait_cb)
+    : uv_udp_send(&sr->req, udp, &buf, 1, dst->in4, _udp_wait_cb);
+  if (rv) {
+    uv_err_t err = uv_last_error(udp->loop);
+    sr->err = err.sys_errno_ ? err.sys_errno_ : EIO;
+    return 1;
+  }
+  return 0;
+}
+
+/* continue the pending sends in order */
+static void _udp_flush(luv_udp_io_t* io) {
+  while (!ngx_queue_empty(&io->sendq)) {
+    ngx_queue_t*    q = ngx_queue_head(&io->sendq);
+    luv_udp_send_t* sr = ngx_queue_data(q, luv_udp_send_t, queue);
+    luv_state_t*    s  = sr->state;
+    if (!_udp_send_some(io, sr) && !_udp_wait(io, sr)) return;
+    ngx_queue_remove(q);
+    _udp_send_result(s->L, sr);
+    luvL_state_ready(s);
+  }
+}
+
+/* the datagram sent by libuv for the oldest send_many went out */
+static void _udp_wait_cb(uv_udp_send_t* req, int status) {
+  luv_udp_send_t* sr   = container_of(req, luv_udp_send_t, req);
+  luv_object_t*   self = container_of(req->handle, luv_object_t, h);
+  luv_udp_io_t*   io   = (luv_udp_io_t*)self->data;
+
+  if (!io) {
+    /* the socket was collected */
+    free(sr->msgs);
+    free(sr);
+    return;
+  }
+  if (status) {
+    uv_err_t err = uv_last_error(req->handle->loop);
+    luv_state_t* s = sr->state;
+    sr->err = err.sys_errno_ ? err.sys_errno_ : EIO;
+    ngx_queue_remove(&sr->queue);
+    _udp_send_result(s->L, sr);
+    luvL_state_ready(s);
+  }
+  else {
+    sr->next++;
+    io->sent++;
+    io->send_batches++;
+  }
+  _udp_flush(io);
+}
+
+/* udp:send_many(msgs), send a table of { data, host, port } datagrams,
+** or of plain strings on a connected socket, with as few syscalls as
+** possible. Returns the number sent and, after an error, the message */
+static int luv_udp_send_many(lua_State* L) {
   luv_object_t* self = (luv_object_t*)luaL_checkudata(L, 1, LUV_NET_UDP_T);
-  if (!luvL_object_is_started(self)) {
-    self->flags |= LUV_OSTARTED;
-    uv_udp_recv_start(&self->h.udp, luvL_alloc_cb, _recv_cb);
+  luv_udp_io_t* io   = _udp_io(self);
+  const char*   last_host = NULL;
+  int           last_port = 0;
+  luv_udp_send_t* sr;
+  size_t i, n;
+
+  luaL_checktype(L, 2, LUA_TTABLE);
+  lua_settop(L, 2); /* the table anchors the strings */
+  n = lua_objlen(L, 2);
+  if (!n) {
+    lua_pushinteger(L, 0);
+    return 1;
   }
-  return luvL_cond_wait(&self->rouse, luvL_state_self(L));
+
+  /* binding can raise, so before anything is allocated. Connected
+  ** sockets are bound already */
+  if (self->h.udp.fd < 0) {
+    int family = PF_INET;
+    lua_rawgeti(L, 2, 1);
+    if (lua_istable(L, -1)) {
+      lua_rawgeti(L, -1, 2);
+      if (lua_type(L, -1) == LUA_TSTRING && strchr(lua_tostring(L, -1), ':')) {
+        family = PF_INET6;
+      }
+      lua_pop(L, 1);
+    }
+    lua_pop(L, 1);
+    _udp_ensure_bound(L, self, family);
+  }
+
+  sr = (luv_udp_send_t*)calloc(1, sizeof(luv_udp_send_t));
+  sr->msgs = (luv_udp_msg_t*)malloc(n * sizeof(luv_udp_msg_t));
+  sr->n    = n;
+  for (i = 0; i < n; i++) {
+    luv_udp_msg_t* m = &sr->msgs[i];
+    lua_rawgeti(L, 2, i + 1);
+    if (lua_type(L, -1) == LUA_TSTRING && io->connected) {
+      m->data = lua_tolstring(L, -1, &m->len);
+#ifdef __linux__
+      memset(&m->addr, 0, sizeof(m->addr));
+#else
+      m->addr = io->peer;
+#endif
+    }
+    else if (lua_istable(L, -1)) {
+      const char* host;
+      int port;
+      lua_rawgeti(L, -1, 1);
+      lua_rawgeti(L, -2, 2);
+      lua_rawgeti(L, -3, 3);
+      /* strings only, converted numbers wouldn't be anchored */
+      if (lua_type(L, -3) != LUA_TSTRING || lua_type(L, -2) != LUA_TSTRING
+          || !lua_isnumber(L, -1)) {
+        free(sr->msgs);
+        free(sr);
+        return luaL_error(L, "send_many: message %d must be { data, host, port }", (int)(i + 1));
+      }
+      m->data = lua_tolstring(L, -3, &m->len);
+      host = lua_tostring(L, -2);
+      port = (int)lua_tointeger(L, -1);
+      /* hosts are usually repeated, reuse the last address */
+      if (host == last_host && port == last_port) {
+        m->addr = sr->msgs[i - 1].addr;
+      }
+      else if (_sockaddr_parse(host, port, &m->addr)) {
+        free(sr->msgs);
+        free(sr);
+        return luaL_error(L, "send_many: message %d: bad address", (int)(i + 1));
+      }
+      else {
+        last_host = host;
+        last_port = port;
+      }
+      lua_pop(L, 3);
+    }
+    else {
+      free(sr->msgs);
+      free(sr);
+      return luaL_error(L, "send_many: message %d must be { data, host, port }%s",
+        (int)(i + 1), io->connected ? " or a string" : "");
+    }
+    lua_pop(L, 1);
+  }
+
+  /* go straight to the socket unless other sends are waiting for it */
+  if (ngx_queue_empty(&io->sendq)
+      && (_udp_send_some(io, sr) || _udp_wait(io, sr))) {
+    return _udp_send_result(L, sr);
+  }
+  sr->state = luvL_state_self(L);
+  ngx_queue_insert_tail(&io->sendq, &sr->queue);
+  return luvL_state_suspend(sr->state);
 }
+#endif /* WIN32 */
 
 static const char* LUV_UDP_MEMBERSHIP_OPTS[] = { "join", "leave", NULL };
 
@@ -383,6 +1369,12 @@ int luv_udp_membership(lua_State* L) {
 
 static int luv_udp_free(lua_State *L) {
   luv_object_t* self = (luv_object_t*)lua_touserdata(L, 1);
+  luv_udp_io_t* io   = (luv_udp_io_t*)self->data;
+  if (io) {
+    _udp_io_clear(io);
+    self->data = NULL;
+    free(io);
+  }
   luvL_object_close(self);
   return 1;
 }
@@ -392,10 +1384,516 @@ static int luv_udp_tostring(lua_State *L) {
   return 1;
 }
 
+#ifndef WIN32
+/* socket options for tcp, udp and pipe objects, by name. Options the
+** platform doesn't have are in the table with `name' -1 */
+typedef struct luv_sockopt_s {
+  int level;
+  int name;
+} luv_sockopt_t;
+
+static const char* LUV_NET_SOCKOPTS[] = {
+  "SO_RCVBUF",            /* 0 */
+  "SO_SNDBUF",            /* 1 */
+  "SO_BUSY_POLL",         /* 2 */
+  "TCP_QUICKACK",         /* 3 */
+  "TCP_NOTSENT_LOWAT",    /* 4 */
+  "TCP_FASTOPEN",         /* 5 */
+  "TCP_DEFER_ACCEPT",     /* 6 */
+  "IP_TOS",               /* 7 */
+  NULL
+};
+
+#define LUV_SOCKOPT_IP_TOS 7
+
+static const luv_sockopt_t LUV_NET_SOCKOPT_VALS[] = {
+  { SOL_SOCKET,  SO_RCVBUF },
+  { SOL_SOCKET,  SO_SNDBUF },
+#ifdef SO_BUSY_POLL
+  { SOL_SOCKET,  SO_BUSY_POLL },
+#else
+  { SOL_SOCKET,  -1 },
+#endif
+#ifdef TCP_QUICKACK
+  { IPPROTO_TCP, TCP_QUICKACK },
+#else
+  { IPPROTO_TCP, -1 },
+#endif
+#ifdef TCP_NOTSENT_LOWAT
+  { IPPROTO_TCP, TCP_NOTSENT_LOWAT },
+#else
+  { IPPROTO_TCP, -1 },
+#endif
+#ifdef TCP_FASTOPEN
+  { IPPROTO_TCP, TCP_FASTOPEN },
+#else
+  { IPPROTO_TCP, -1 },
+#endif
+#ifdef TCP_DEFER_ACCEPT
+  { IPPROTO_TCP, TCP_DEFER_ACCEPT },
+#else
+  { IPPROTO_TCP, -1 },
+#endif
+  { IPPROTO_IP,  IP_TOS }
+};
+
+/* the socket of the tcp, udp or pipe object at 1, and the option named
+** at 2. Returns -1 with an error message pushed if either is missing */
+static int _sockopt_check(lua_State* L, luv_sockopt_t* opt) {
+  luv_object_t* self = (luv_object_t*)lua_touserdata(L, 1);
+  int fd = -1, k;
+
+  if (self && lua_getmetatable(L, 1)) {
+    luaL_getmetatable(L, LUV_NET_TCP_T);
+    luaL_getmetatable(L, LUV_PIPE_T);
+    luaL_getmetatable(L, LUV_NET_UDP_T);
+    if (lua_rawequal(L, -4, -3) || lua_rawequal(L, -4, -2)) {
+      fd = self->h.stream.fd;
+    }
+    else if (lua_rawequal(L, -4, -1)) {
+      fd = self->h.udp.fd;
+    }
+    else {
+      self = NULL;
+    }
+    lua_pop(L, 4);
+  }
+  else {
+    self = NULL;
+  }
+  if (!self) luaL_typerror(L, 1, "tcp, udp or pipe");
+
+  k = luaL_checkoption(L, 2, NULL, LUV_NET_SOCKOPTS);
+  *opt = LUV_NET_SOCKOPT_VALS[k];
+
+  if (opt->name < 0) {
+    lua_pushnil(L);
+    lua_pushfstring(L, "%s is not supported on this platform", LUV_NET_SOCKOPTS[k]);
+    return -1;
+  }
+  if (fd < 0) {
+    lua_pushnil(L);
+    lua_pushliteral(L, "socket is not open");
+    return -1;
+  }
+  if (k == LUV_SOCKOPT_IP_TOS) {
+    /* the traffic class is the IPv6 equivalent */
+    struct sockaddr_storage name;
+    socklen_t len = sizeof(name);
+    if (!getsockname(fd, (struct sockaddr*)&name, &len) && name.ss_family == AF_INET6) {
+      opt->level = IPPROTO_IPV6;
+      opt->name  = IPV6_TCLASS;
+    }
+  }
+  return fd;
+}
+
+/* sock:setsockopt(opt, val), val is a number or a boolean. Returns true,
+** or false and an error */
+int luvL_net_setsockopt(lua_State* L) {
+  luv_sockopt_t opt;
+  int fd = _sockopt_check(L, &opt);
+  int val;
+  if (fd < 0) {
+    lua_pushboolean(L, 0);
+    lua_replace(L, -3);
+    return 2;
+  }
+  if (lua_type(L, 3) == LUA_TBOOLEAN) {
+    val = lua_toboolean(L, 3);
+  }
+  else {
+    val = luaL_checkint(L, 3);
+  }
+  if (setsockopt(fd, opt.level, opt.name, &val, sizeof(val))) {
+    lua_pushboolean(L, 0);
+    lua_pushstring(L, strerror(errno));
+    return 2;
+  }
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+/* sock:getsockopt(opt), returns the value as a number, or nil and an
+** error */
+int luvL_net_getsockopt(lua_State* L) {
+  luv_sockopt_t opt;
+  int fd = _sockopt_check(L, &opt);
+  int val = 0;
+  socklen_t len = sizeof(val);
+  if (fd < 0) {
+    return 2;
+  }
+  if (getsockopt(fd, opt.level, opt.name, &val, &len)) {
+    lua_pushnil(L);
+    lua_pushstring(L, strerror(errno));
+    return 2;
+  }
+  lua_pushinteger(L, val);
+  return 1;
+}
+#endif
+
+/* body of each luv.net.serve thread */
+static const char LUV_NET_SERVE[] =
+  "local luv, host, port, handler, backlog = ...\n"
+  "local server = luv.net.tcp()\n"
+  "assert(server:bind(host, port, { reuseport = true }) == 0, \"bind failed\")\n"
+  "server:listen(backlog)\n"
+  "while true do\n"
+  "  for _, client in ipairs(server:accept_many()) do\n"
+  "    luv.fiber.create(handler, client):ready()\n"
+  "  end\n"
+  "end\n";
+
+/* luv.net.serve(host, port, nthreads, handler, [backlog]), listen on
+** host:port from `nthreads' new threads, one reuseport listener each,
+** and run handler(client) in a fiber of the accepting thread. Returns
+** a table of the threads */
+static int luv_net_serve(lua_State* L) {
+  luv_state_t* curr = luvL_state_self(L);
+  int i, nthreads;
+  luaL_checkstring(L, 1);
+  luaL_checkinteger(L, 2);
+  nthreads = luaL_checkint(L, 3);
+  luaL_checktype(L, 4, LUA_TFUNCTION);
+  luaL_argcheck(L, nthreads > 0, 3, "need at least one thread");
+  lua_settop(L, 5);
+  if (lua_isnil(L, 5)) {
+    lua_pushinteger(L, 128);
+    lua_replace(L, 5);
+  }
+
+  lua_createtable(L, nthreads, 0);
+  for (i = 1; i <= nthreads; i++) {
+    if (luaL_loadbuffer(L, LUV_NET_SERVE, sizeof(LUV_NET_SERVE) - 1, "=luv.net.serve")) {
+      return lua_error(L);
+    }
+    lua_getfield(L, LUA_REGISTRYINDEX, "luv");
+    lua_pushvalue(L, 1);
+    lua_pushvalue(L, 2);
+    lua_pushvalue(L, 4);
+    lua_pushvalue(L, 5);
+    luvL_thread_create(curr, 6);
+    lua_rawseti(L, -2, i);
+  }
+  return 1;
+}
+
+/* an idle connection of a pool, anchored in the registry */
+typedef struct luv_pool_conn_s {
+  ngx_queue_t   queue;
+  luv_object_t* conn;
+  int           ref;
+  uint64_t      since; /* uv_now() when released */
+} luv_pool_conn_t;
+
+#define _pool_check(L, idx) \
+  (*(luv_net_pool_t**)luaL_checkudata(L, idx, LUV_NET_POOL_T))
+
+static void _pool_dispatch(luv_net_pool_t* pool);
+
+/* the connect of a fiber in acquire, whose stack is [ pool, tcp ] */
+static void _pool_connect_done(luv_connect_t* c, const char* err) {
+  luv_net_pool_t* pool = (luv_net_pool_t*)c->data;
+  lua_State* L = c->state->L;
+
+  pool->pending--;
+  if (err) {
+    pool->failed++;
+    luvL_stream_close(c->self);
+    lua_settop(L, 0);
+    lua_pushnil(L);
+    lua_pushfstring(L, "connect: %s", err);
+  }
+  else {
+    pool->active++;
+    pool->connects++;
+    lua_remove(L, 1);
+    /* [ tcp ] */
+  }
+  if (c->suspended) {
+    luvL_state_ready(c->state);
+    if (err) _pool_dispatch(pool);
+  }
+}
+
+/* connect a new tcp object for `state', whose stack is [ pool ]. Returns
+** 1 if that already failed, with the results on its stack, otherwise
+** `state' is made ready once connected */
+static int _pool_connect(luv_net_pool_t* pool, luv_state_t* state) {
+  lua_State* L = state->L;
+  luv_connect_t* c;
+  luv_object_t* conn;
+
+  conn = (luv_object_t*)lua_newuserdata(L, sizeof(luv_object_t));
+  luaL_getmetatable(L, LUV_NET_TCP_T);
+  lua_setmetatable(L, -2);
+  luvL_object_init(state, conn);
+  uv_tcp_init(state->loop, &conn->h.tcp);
+
+  pool->pending++;
+  c = _connect_new(conn, state, _pool_connect_done, pool);
+  _connect_start(c, pool->host, pool->port);
+  if (c->done) {
+    return 1;
+  }
+  c->suspended = 1;
+  return 0;
+}
+
+/* start connects for waiting fibers while there is room */
+static void _pool_dispatch(luv_net_pool_t* pool) {
+  while (pool->nwaiting && !pool->closed && pool->active + pool->pending < pool->max) {
+    ngx_queue_t* q = ngx_queue_head(&pool->waiters);
+    luv_state_t* s = ngx_queue_data(q, luv_state_t, cond);
+    ngx_queue_remove(q);
+    pool->nwaiting--;
+    if (_pool_connect(pool, s)) {
+      luvL_state_ready(s);
+    }
+  }
+}
+
+static void _pool_drop(luv_net_pool_t* pool, luv_pool_conn_t* pc) {
+  luv_thread_t* thread = (luv_thread_t*)pool->timer.loop->data;
+  ngx_queue_remove(&pc->queue);
+  pool->nidle--;
+  luvL_stream_close(pc->conn);
+  luaL_unref(thread->L, LUA_REGISTRYINDEX, pc->ref);
+  free(pc);
+}
+
+static void _pool_timer_cb(uv_timer_t* handle, int status) {
+  luv_net_pool_t* pool = (luv_net_pool_t*)handle->data;
+  uint64_t now = uv_now(handle->loop);
+  while (!ngx_queue_empty(&pool->idle)) {
+    ngx_queue_t* q = ngx_queue_head(&pool->idle);
+    luv_pool_conn_t* pc = ngx_queue_data(q, luv_pool_conn_t, queue);
+    if (pc->since + pool->idle_timeout > now) {
+      uv_timer_start(handle, _pool_timer_cb, pc->since + pool->idle_timeout - now, 0);
+      return;
+    }
+    pool->expired++;
+    _pool_drop(pool, pc);
+  }
+}
+
+static void _pool_close_cb(uv_handle_t* handle) {
+  luv_net_pool_t* pool = (luv_net_pool_t*)handle->data;
+  free(pool->host);
+  free(pool);
+}
+
+/* luv.net.pool{ host = host, port = port, [max = 16], [idle_timeout = 60] } */
+static int luv_net_pool(lua_State* L) {
+  luv_net_pool_t** self;
+  luv_net_pool_t*  pool;
+  const char* host;
+  int port, max;
+  lua_Number idle;
+
+  luaL_checktype(L, 1, LUA_TTABLE);
+  lua_getfield(L, 1, "host");
+  lua_getfield(L, 1, "port");
+  lua_getfield(L, 1, "max");
+  lua_getfield(L, 1, "idle_timeout");
+  host = luaL_checkstring(L, -4);
+  port = luaL_checkint(L, -3);
+  max  = luaL_optint(L, -2, 16);
+  idle = luaL_optnumber(L, -1, 60);
+  luaL_argcheck(L, max > 0, 1, "max must be positive");
+  luaL_argcheck(L, idle >= 0, 1, "idle_timeout must not be negative");
+
+  pool = (luv_net_pool_t*)calloc(1, sizeof(luv_net_pool_t));
+  pool->host = strdup(host);
+  snprintf(pool->port, sizeof(pool->port), "%d", port);
+  pool->max  = max;
+  pool->idle_timeout = (uint64_t)(idle * 1000);
+  ngx_queue_init(&pool->idle);
+  ngx_queue_init(&pool->waiters);
+  uv_timer_init(luvL_event_loop(L), &pool->timer);
+  pool->timer.data = pool;
+  /* idle connections shouldn't keep the loop alive */
+  uv_unref((uv_handle_t*)&pool->timer);
+
+  self = (luv_net_pool_t**)lua_newuserdata(L, sizeof(luv_net_pool_t*));
+  luaL_getmetatable(L, LUV_NET_POOL_T);
+  lua_setmetatable(L, -2);
+  *self = pool;
+  return 1;
+}
+
+/* pool:acquire(), returns a connected tcp object, or nil and an error */
+static int luv_net_pool_acquire(lua_State* L) {
+  luv_net_pool_t* pool = _pool_check(L, 1);
+  luv_state_t*    curr = luvL_state_self(L);
+
+  if (pool->closed) {
+    lua_pushnil(L);
+    lua_pushliteral(L, "acquire: pool is closed");
+    return 2;
+  }
+  pool->acquired++;
+  lua_settop(L, 1);
+
+  /* most recently used first, it's the least likely to be stale */
+  while (!ngx_queue_empty(&pool->idle)) {
+    ngx_queue_t* q = ngx_queue_last(&pool->idle);
+    luv_pool_conn_t* pc = ngx_queue_data(q, luv_pool_conn_t, queue);
+    if (luvL_stream_alive(pc->conn)) {
+      lua_rawgeti(L, LUA_REGISTRYINDEX, pc->ref);
+      luaL_unref(L, LUA_REGISTRYINDEX, pc->ref);
+      ngx_queue_remove(q);
+      pool->nidle--;
+      free(pc);
+      pool->active++;
+      pool->reused++;
+      return 1;
+    }
+    pool->dead++;
+    _pool_drop(pool, pc);
+  }
+
+  if (pool->active + pool->pending < pool->max) {
+    if (_pool_connect(pool, curr)) {
+      return lua_gettop(L);
+    }
+    return luvL_state_suspend(curr);
+  }
+
+  pool->waited++;
+  pool->nwaiting++;
+  return luvL_cond_wait(&pool->waiters, curr);
+}
+
+/* pool:release(tcp, [reuse]), give back a connection from acquire. It's
+** closed instead of kept if `reuse' is false or it looks dead */
+static int luv_net_pool_release(lua_State* L) {
+  luv_net_pool_t* pool = _pool_check(L, 1);
+  luv_object_t*   conn = (luv_object_t*)luaL_checkudata(L, 2, LUV_NET_TCP_T);
+  int reuse = lua_isnoneornil(L, 3) || lua_toboolean(L, 3);
+
+  if (pool->active > 0) pool->active--;
+
+  if (reuse && !pool->closed && luvL_stream_alive(conn)) {
+    if (luvL_object_is_started(conn)) {
+      luvL_stream_stop(conn);
+    }
+    if (pool->nwaiting) {
+      /* straight to the next fiber in line */
+      ngx_queue_t* q = ngx_queue_head(&pool->waiters);
+      luv_state_t* s = ngx_queue_data(q, luv_state_t, cond);
+      ngx_queue_remove(q);
+      pool->nwaiting--;
+      lua_settop(s->L, 0);
+      lua_pushvalue(L, 2);
+      lua_xmove(L, s->L, 1);
+      pool->active++;
+      pool->reused++;
+      luvL_state_ready(s);
+    }
+    else {
+      luv_pool_conn_t* pc = (luv_pool_conn_t*)malloc(sizeof(luv_pool_conn_t));
+      lua_pushvalue(L, 2);
+      pc->ref   = luaL_ref(L, LUA_REGISTRYINDEX);
+      pc->conn  = conn;
+      pc->since = uv_now(pool->timer.loop);
+      ngx_queue_insert_tail(&pool->idle, &pc->queue);
+      pool->nidle++;
+      if (pool->idle_timeout && !uv_is_active((uv_handle_t*)&pool->timer)) {
+        uv_timer_start(&pool->timer, _pool_timer_cb, pool->idle_timeout, 0);
+      }
+    }
+    return 0;
+  }
+
+  if (!luvL_object_is_closing(conn)) {
+    luvL_stream_close(conn);
+  }
+  _pool_dispatch(pool);
+  return 0;
+}
+
+/* pool:stats(), counters and current utilisation */
+static int luv_net_pool_stats(lua_State* L) {
+  luv_net_pool_t* pool = _pool_check(L, 1);
+  lua_createtable(L, 0, 14);
+  lua_pushinteger(L, pool->max);
+  lua_setfield(L, -2, "max");
+  lua_pushinteger(L, pool->active);
+  lua_setfield(L, -2, "active");
+  lua_pushinteger(L, pool->nidle);
+  lua_setfield(L, -2, "idle");
+  lua_pushinteger(L, pool->pending);
+  lua_setfield(L, -2, "pending");
+  lua_pushinteger(L, pool->nwaiting);
+  lua_setfield(L, -2, "waiting");
+  lua_pushnumber(L, (lua_Number)(pool->active + pool->pending) / pool->max);
+  lua_setfield(L, -2, "utilisation");
+  lua_pushnumber(L, (lua_Number)pool->acquired);
+  lua_setfield(L, -2, "acquired");
+  lua_pushnumber(L, (lua_Number)pool->connects);
+  lua_setfield(L, -2, "connects");
+  lua_pushnumber(L, (lua_Number)pool->reused);
+  lua_setfield(L, -2, "reused");
+  lua_pushnumber(L, (lua_Number)pool->dead);
+  lua_setfield(L, -2, "dead");
+  lua_pushnumber(L, (lua_Number)pool->expired);
+  lua_setfield(L, -2, "expired");
+  lua_pushnumber(L, (lua_Number)pool->waited);
+  lua_setfield(L, -2, "waited");
+  lua_pushnumber(L, (lua_Number)pool->failed);
+  lua_setfield(L, -2, "failed");
+  return 1;
+}
+
+/* pool:close(), close idle connections and fail waiting acquires.
+** Connections which are handed out are closed when released */
+static int luv_net_pool_close(lua_State* L) {
+  luv_net_pool_t* pool = _pool_check(L, 1);
+  if (pool->closed) return 0;
+  pool->closed = 1;
+  uv_timer_stop(&pool->timer);
+  while (!ngx_queue_empty(&pool->idle)) {
+    ngx_queue_t* q = ngx_queue_head(&pool->idle);
+    _pool_drop(pool, ngx_queue_data(q, luv_pool_conn_t, queue));
+  }
+  while (!ngx_queue_empty(&pool->waiters)) {
+    ngx_queue_t* q = ngx_queue_head(&pool->waiters);
+    luv_state_t* s = ngx_queue_data(q, luv_state_t, cond);
+    ngx_queue_remove(q);
+    lua_settop(s->L, 0);
+    lua_pushnil(s->L);
+    lua_pushliteral(s->L, "acquire: pool is closed");
+    luvL_state_ready(s);
+  }
+  pool->nwaiting = 0;
+  return 0;
+}
+
+static int luv_net_pool_free(lua_State* L) {
+  luv_net_pool_t* pool = *(luv_net_pool_t**)lua_touserdata(L, 1);
+  luv_net_pool_close(L);
+  uv_close((uv_handle_t*)&pool->timer, _pool_close_cb);
+  return 0;
+}
+
+static int luv_net_pool_tostring(lua_State* L) {
+  luv_net_pool_t* pool = _pool_check(L, 1);
+  lua_pushfstring(L, "userdata<%s>: %s:%s", LUV_NET_POOL_T, pool->host, pool->port);
+  return 1;
+}
+
 luaL_Reg luv_net_funcs[] = {
   {"tcp",         luv_new_tcp},
   {"udp",         luv_new_udp},
   {"getaddrinfo", luv_getaddrinfo},
+  {"dns_ttl",     luv_net_dns_ttl},
+  {"dns_flush",   luv_net_dns_flush},
+  {"dns_stats",   luv_net_dns_stats},
+  {"serve",       luv_net_serve},
+  {"pool",        luv_net_pool},
   {NULL,          NULL}
 };
 
@@ -413,10 +1911,29 @@ luaL_Reg luv_net_tcp_meths[] = {
 luaL_Reg luv_net_udp_meths[] = {
   {"bind",      luv_udp_bind},
   {"send",      luv_udp_send},
+#ifndef WIN32
+  {"send_many", luv_udp_send_many},
+  {"connect",   luv_udp_connect},
+  {"setsockopt",luvL_net_setsockopt},
+  {"getsockopt",luvL_net_getsockopt},
+#endif
   {"recv",      luv_udp_recv},
+  {"recv_into", luv_udp_recv_into},
+  {"recv_many", luv_udp_recv_many},
+  {"backlog",   luv_udp_backlog},
+  {"stats",     luv_udp_stats},
   {"membership",luv_udp_membership},
   {"__gc",      luv_udp_free},
   {"__tostring",luv_udp_tostring},
   {NULL,        NULL}
 };
 
+luaL_Reg luv_net_pool_meths[] = {
+  {"acquire",   luv_net_pool_acquire},
+  {"release",   luv_net_pool_release},
+  {"stats",     luv_net_pool_stats},
+  {"close",     luv_net_pool_close},
+  {"__gc",      luv_net_pool_free},
+  {"__tostring",luv_net_pool_tostring},
+  {NULL,        NULL}
+};
@@ -0,0 +1,79 @@
+#include "luv.h"
+
+/* Per-loop read buffer pool. Buffers are rounded up to a power of two
+** size class between 512 bytes and 64k and kept on a free list per class,
+** linked through their first bytes. Larger requests bypass the pool.
+** Released buffers are freed instead of cached once the pool holds more
+** than LUV_POOL_HIGH bytes. */
+
+#define LUV_POOL_MIN_SHIFT 9
+
+typedef struct luv_pool_link_s {
+  struct luv_pool_link_s* next;
+} luv_pool_link_t;
+
+static int pool_class(size_t size) {
+  int i;
+  for (i = 0; i < LUV_POOL_CLASSES; i++) {
+    if (size <= ((size_t)1 << (i + LUV_POOL_MIN_SHIFT))) return i;
+  }
+  return -1;
+}
+
+void luvL_pool_init(luv_pool_t* pool) {
+  memset(pool, 0, sizeof(luv_pool_t));
+}
+
+void luvL_pool_close(luv_pool_t* pool) {
+  int i;
+  for (i = 0; i < LUV_POOL_CLASSES; i++) {
+    luv_pool_link_t* link = (luv_pool_link_t*)pool->free[i];
+    while (link) {
+      luv_pool_link_t* next = link->next;
+      free(link);
+      link = next;
+    }
+    pool->free[i] = NULL;
+  }
+  pool->bytes = 0;
+}
+
+/* the pool of the thread running `loop', or NULL */
+luv_pool_t* luvL_pool_self(uv_loop_t* loop) {
+  luv_thread_t* thread = (luv_thread_t*)loop->data;
+  return thread ? &thread->pool : NULL;
+}
+
+uv_buf_t luvL_pool_alloc(luv_pool_t* pool, size_t size) {
+  int k = pool_class(size);
+  if (pool && k >= 0) {
+    size = (size_t)1 << (k + LUV_POOL_MIN_SHIFT);
+    if (pool->free[k]) {
+      luv_pool_link_t* link = (luv_pool_link_t*)pool->free[k];
+      pool->free[k] = link->next;
+      pool->bytes  -= size;
+      pool->hits++;
+      return uv_buf_init((char*)link, size);
+    }
+    pool->misses++;
+  }
+  return uv_buf_init((char*)malloc(size), size);
+}
+
+/* return a buffer from luvL_pool_alloc, `buf.len' must be unchanged */
+void luvL_pool_release(luv_pool_t* pool, uv_buf_t buf) {
+  int k;
+  if (!buf.base) return;
+  k = pool_class(buf.len);
+  if (pool && k >= 0 && buf.len == ((size_t)1 << (k + LUV_POOL_MIN_SHIFT))) {
+    if (pool->bytes + buf.len <= LUV_POOL_HIGH) {
+      luv_pool_link_t* link = (luv_pool_link_t*)buf.base;
+      link->next = (luv_pool_link_t*)pool->free[k];
+      pool->free[k] = link;
+      pool->bytes  += buf.len;
+      return;
+    }
+    pool->trims++;
+  }
+  free(buf.base);
+}
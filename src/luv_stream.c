@@ -1,10 +1,26 @@
 #include "luv.h"
 
-/* used by udp and stream */
+#ifndef WIN32
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#endif
+
+#if defined(__linux__)
+#include <sys/sendfile.h>
+#elif defined(__APPLE__) || defined(__FreeBSD__)
+#include <sys/socket.h>
+#include <sys/uio.h>
+#endif
+
+/* used by udp and stream, buffers come from the loop's pool and must be
+** returned to it with luvL_pool_release */
 uv_buf_t luvL_alloc_cb(uv_handle_t* handle, size_t size) {
   luv_object_t* self = container_of(handle, luv_object_t, h);
-  size = (size_t)self->buf.len;
-  return uv_buf_init((char*)malloc(size), size);
+  if (self->buf.len) size = (size_t)self->buf.len;
+  return luvL_pool_alloc(luvL_pool_self(handle->loop), size);
 }
 
 /* used by tcp and pipe */
@@ -13,65 +29,239 @@ void luvL_connect_cb(uv_connect_t* req, int status) {
   luvL_state_ready(state);
 }
 
-static void _read_cb(uv_stream_t* stream, ssize_t len, uv_buf_t buf) {
-  TRACE("got data\n");
-  luv_object_t* self  = container_of(stream, luv_object_t, h);
+luv_stream_io_t* luvL_stream_io(luv_object_t* self) {
+  luv_stream_io_t* io = (luv_stream_io_t*)self->data;
+  if (!io) {
+    io = (luv_stream_io_t*)calloc(1, sizeof(luv_stream_io_t));
+    io->rbuf.high = LUV_RBUF_HIGH;
+    io->rbuf.low  = LUV_RBUF_LOW;
+    ngx_queue_init(&io->wqueue.drain);
+    ngx_queue_init(&io->wqueue.flush);
+    io->wqueue.cref = LUA_NOREF;
+    io->wqueue.sref = LUA_NOREF;
+    io->accept.aref = LUA_NOREF;
+    io->accept.handler = LUA_NOREF;
+    io->object = self;
+    ngx_queue_init(&io->corked);
+    self->data = io;
+  }
+  return io;
+}
 
-  if (ngx_queue_empty(&self->rouse)) {
-    TRACE("empty read queue, save buffer and stop read\n");
-    luvL_stream_stop(self);
-    if (len >= 0) {
-      self->buf   = buf;
-      self->count = len;
+#define luvL_stream_rbuf(O)   (&luvL_stream_io(O)->rbuf)
+#define luvL_stream_wqueue(O) (&luvL_stream_io(O)->wqueue)
+
+static void _cork_drop(luv_object_t* self);
+
+static void _stream_io_free(luv_object_t* self) {
+  luv_stream_io_t* io = (luv_stream_io_t*)self->data;
+  if (io) {
+    luv_thread_t* thread = (luv_thread_t*)self->h.handle.loop->data;
+    luv_wreq_t* wreq;
+    _cork_drop(self);
+    luaL_unref(thread->L, LUA_REGISTRYINDEX, io->accept.aref);
+    luaL_unref(thread->L, LUA_REGISTRYINDEX, io->accept.handler);
+    luaL_unref(thread->L, LUA_REGISTRYINDEX, io->wqueue.sref);
+    wreq = io->wqueue.free;
+    while (wreq) {
+      luv_wreq_t* next = wreq->next;
+      free(wreq);
+      wreq = next;
     }
-    else {
-      if (buf.base) {
-        free(buf.base);
-        buf.base = NULL;
-        buf.len  = 0;
+    free(io->rbuf.base);
+    free(io);
+    self->data = NULL;
+  }
+}
+
+static void _rbuf_append(luv_rbuf_t* rbuf, const char* data, size_t len) {
+  if (rbuf->wpos + len > rbuf->size) {
+    size_t used = rbuf->wpos - rbuf->rpos;
+    if (rbuf->rpos) {
+      memmove(rbuf->base, rbuf->base + rbuf->rpos, used);
+      rbuf->rpos = 0;
+      rbuf->wpos = used;
+    }
+    if (used + len > rbuf->size) {
+      size_t size = rbuf->size ? rbuf->size : 4096;
+      while (size < used + len) size *= 2;
+      rbuf->base = (char*)realloc(rbuf->base, size);
+      rbuf->size = size;
+    }
+  }
+  memcpy(rbuf->base + rbuf->wpos, data, len);
+  rbuf->wpos += len;
+}
+
+/* drop `len' consumed bytes and resume reading below the low watermark */
+static void _rbuf_consume(luv_object_t* self, luv_rbuf_t* rbuf, size_t len) {
+  rbuf->rpos += len;
+  rbuf->scan  = 0;
+  if (rbuf->rpos == rbuf->wpos) {
+    rbuf->rpos = rbuf->wpos = 0;
+    if (rbuf->size > LUV_RBUF_LOW) {
+      /* don't keep large buffers around on idle streams */
+      free(rbuf->base);
+      rbuf->base = NULL;
+      rbuf->size = 0;
+    }
+  }
+  if (rbuf->paused && rbuf->wpos - rbuf->rpos < rbuf->low) {
+    rbuf->paused = 0;
+    luvL_stream_start(self);
+  }
+}
+
+/* kinds of read, a waiting reader keeps its kind at index 3 of its
+** stack and its argument at index 2 */
+#define LUV_READ_SOME  0
+#define LUV_READ_EXACT 1
+#define LUV_READ_UNTIL 2
+#define LUV_READ_LINE  3
+#define LUV_READ_INTO  4
+
+/* find the next frame for a reader of `kind'. Returns its length, with
+** `skip' set to the trailing bytes to consume but not return, or -1 if
+** the frame isn't complete yet */
+static ptrdiff_t _rbuf_frame(lua_State* L, luv_rbuf_t* rbuf, int kind, size_t* skip) {
+  const char* data = rbuf->base + rbuf->rpos;
+  size_t used = rbuf->wpos - rbuf->rpos;
+  *skip = 0;
+
+  switch (kind) {
+  case LUV_READ_SOME: {
+    size_t len = lua_isnumber(L, 2) ? (size_t)lua_tointeger(L, 2) : 4096;
+    if (!used) return -1;
+    return len < used ? len : used;
+  }
+  case LUV_READ_EXACT: {
+    size_t len = (size_t)lua_tointeger(L, 2);
+    return len <= used ? (ptrdiff_t)len : -1;
+  }
+  case LUV_READ_INTO: {
+    size_t len = ((luv_buffer_t*)lua_touserdata(L, 2))->size;
+    if (!used) return -1;
+    return len < used ? len : used;
+  }
+  case LUV_READ_UNTIL:
+  case LUV_READ_LINE: {
+    size_t dlen = 1;
+    const char* delim = "\n";
+    const char* p;
+    if (kind == LUV_READ_UNTIL) delim = lua_tolstring(L, 2, &dlen);
+
+    /* bytes before rbuf->scan are known not to start a match */
+    p = used ? data + rbuf->scan : NULL;
+    while (p && (p = (const char*)memchr(p, delim[0], data + used - p))) {
+      if ((size_t)(data + used - p) < dlen) break;
+      if (dlen == 1 || !memcmp(p, delim, dlen)) {
+        size_t len = p - data + dlen;
+        if (kind == LUV_READ_LINE) {
+          /* strip the line ending */
+          *skip = (len > 1 && p[-1] == '\r') ? 2 : 1;
+          len -= *skip;
+        }
+        return len;
       }
+      p++;
     }
+    rbuf->scan = used >= dlen ? used - dlen + 1 : 0;
+
+    /* a last line needn't be terminated */
+    if (kind == LUV_READ_LINE && rbuf->eof && used) return used;
+    return -1;
   }
-  else {
-    TRACE("have states waiting...\n");
-    ngx_queue_t* q;
-    luv_state_t* s;
+  }
+  return -1;
+}
+
+/* push the next frame, or nil at EOF or false and a message on error.
+** Returns the number of values pushed, or 0 if the reader has to wait */
+static int _rbuf_push(lua_State* L, luv_object_t* self, int kind, int top) {
+  luv_rbuf_t* rbuf = luvL_stream_rbuf(self);
+  size_t skip;
+  ptrdiff_t len = _rbuf_frame(L, rbuf, kind, &skip);
+
+  if (len < 0 && !rbuf->eof && rbuf->err.code == UV_OK) return 0;
+
+  if (len >= 0 && kind == LUV_READ_INTO) {
+    luv_buffer_t* into = (luv_buffer_t*)lua_touserdata(L, 2);
+    memcpy(into->data, rbuf->base + rbuf->rpos, len);
+    lua_settop(L, top);
+    lua_pushinteger(L, len);
+    _rbuf_consume(self, rbuf, len);
+    return 1;
+  }
+  lua_settop(L, top);
+  if (len >= 0) {
+    if (kind == LUV_READ_SOME) lua_pushinteger(L, len);
+    lua_pushlstring(L, rbuf->base + rbuf->rpos, len);
+    _rbuf_consume(self, rbuf, len + skip);
+    return kind == LUV_READ_SOME ? 2 : 1;
+  }
+  rbuf->scan = 0;
+  if (rbuf->eof) {
+    lua_pushnil(L);
+    return 1;
+  }
+  lua_pushboolean(L, 0);
+  lua_pushfstring(L, "read: %s", uv_strerror(rbuf->err));
+  return 2;
+}
+
+/* hand buffered data to waiting readers, in order */
+static void _rbuf_wake(luv_object_t* self) {
+  while (!ngx_queue_empty(&self->rouse)) {
+    ngx_queue_t* q = ngx_queue_head(&self->rouse);
+    luv_state_t* s = ngx_queue_data(q, luv_state_t, cond);
+
+    if (!_rbuf_push(s->L, self, lua_tointeger(s->L, 3), 0)) break;
 
-    q = ngx_queue_head(&self->rouse);
-    s = ngx_queue_data(q, luv_state_t, cond);
     ngx_queue_remove(q);
+    TRACE("wake up state: %p\n", s);
+    luvL_state_ready(s);
+  }
+}
 
-    TRACE("data - len: %i\n", (int)len);
+static void _splice_read(luv_object_t* self, ssize_t len, uv_buf_t buf);
 
-    lua_settop(s->L, 0);
-    if (len >= 0) {
-      lua_pushinteger(s->L, len);
-      lua_pushlstring(s->L, (char*)buf.base, len);
-      if (len == 0) luvL_stream_stop(self);
+static void _read_cb(uv_stream_t* stream, ssize_t len, uv_buf_t buf) {
+  luv_object_t* self = container_of(stream, luv_object_t, h);
+  luv_rbuf_t*   rbuf = luvL_stream_rbuf(self);
+
+  if (luvL_stream_io(self)->splice) {
+    _splice_read(self, len, buf);
+    return;
+  }
+
+  TRACE("data - len: %i\n", (int)len);
+  if (len > 0) {
+    _rbuf_append(rbuf, buf.base, len);
+  }
+  else if (len < 0) {
+    uv_err_t err = uv_last_error(stream->loop);
+    luvL_stream_stop(self);
+    if (err.code == UV_EOF) {
+      TRACE("GOT EOF\n");
+      rbuf->eof = 1;
     }
     else {
-      uv_err_t err = uv_last_error(s->loop);
-      if (err.code == UV_EOF) {
-        TRACE("GOT EOF\n");
-        lua_settop(s->L, 0);
-        lua_pushnil(s->L);
-      }
-      else {
-        lua_settop(s->L, 0);
-        lua_pushboolean(s->L, 0);
-        lua_pushfstring(s->L, "read: %s", uv_strerror(err));
-        TRACE("READ ERROR, CLOSING STREAM\n");
-        luvL_stream_stop(self);
-        luvL_object_close(self);
-      }
+      TRACE("READ ERROR, CLOSING STREAM\n");
+      rbuf->err = err;
+      luvL_object_close(self);
     }
-    if (buf.base) {
-      free(buf.base);
-      buf.len  = 0;
-      buf.base = NULL;
-    }
-    TRACE("wake up state: %p\n", s);
-    luvL_state_ready(s);
+  }
+  luvL_pool_release(luvL_pool_self(stream->loop), buf);
+
+  _rbuf_wake(self);
+
+  /* keep reading past the high watermark while a reader waits for a
+  ** frame larger than that */
+  if (rbuf->wpos - rbuf->rpos >= rbuf->high && ngx_queue_empty(&self->rouse)
+      && luvL_object_is_started(self)) {
+    TRACE("high watermark, stop read\n");
+    luvL_stream_stop(self);
+    rbuf->paused = 1;
   }
 }
 
@@ -91,10 +281,109 @@ static void _shutdown_cb(uv_shutdown_t* req, int status) {
   luvL_cond_signal(&self->rouse);
 }
 
+static void _accept_close_cb(uv_handle_t* handle) {
+  luv_object_t* conn   = container_of(handle, luv_object_t, h);
+  luv_thread_t* thread = (luv_thread_t*)handle->loop->data;
+  conn->flags |= LUV_OCLOSED;
+  luaL_unref(thread->L, LUA_REGISTRYINDEX, conn->ref);
+}
+
+/* accept a pending handle of `type' from `server' into a new object and
+** push it, or push nothing and return NULL. Used by listeners and for
+** handles received over IPC pipes */
+luv_object_t* luvL_stream_accept_new(lua_State* L, uv_stream_t* server, uv_handle_type type) {
+  uv_loop_t* loop = server->loop;
+  luv_object_t* conn = (luv_object_t*)lua_newuserdata(L, sizeof(luv_object_t));
+  luvL_object_init((luv_state_t*)loop->data, conn);
+  if (type == UV_NAMED_PIPE) {
+    int ipc = server->type == UV_NAMED_PIPE ? ((uv_pipe_t*)server)->ipc : 0;
+    luaL_getmetatable(L, LUV_PIPE_T);
+    uv_pipe_init(loop, &conn->h.pipe, ipc);
+  }
+  else {
+    luaL_getmetatable(L, LUV_NET_TCP_T);
+    uv_tcp_init(loop, &conn->h.tcp);
+  }
+  lua_setmetatable(L, -2);
+
+  if (uv_accept(server, &conn->h.stream)) {
+    TRACE("ERROR: %s\n", uv_strerror(uv_last_error(loop)));
+    /* keep it alive until libuv is done with it */
+    conn->flags |= LUV_OCLOSING;
+    conn->ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    uv_close(&conn->h.handle, _accept_close_cb);
+    return NULL;
+  }
+  ((luv_thread_t*)loop->data)->accepted++;
+  return conn;
+}
+
+/* move up to `max' queued connections into a new table */
+static void _accept_push(lua_State* L, luv_accept_t* acc, int max) {
+  int i, n = acc->atail - acc->ahead;
+  if (n > max) n = max;
+  lua_createtable(L, n, 0);
+  lua_rawgeti(L, LUA_REGISTRYINDEX, acc->aref);
+  for (i = 1; i <= n; i++) {
+    lua_rawgeti(L, -1, acc->ahead + i);
+    lua_rawseti(L, -3, i);
+    lua_pushnil(L);
+    lua_rawseti(L, -2, acc->ahead + i);
+  }
+  lua_pop(L, 1);
+  acc->ahead += n;
+  if (acc->ahead == acc->atail) {
+    acc->ahead = acc->atail = 0;
+  }
+}
+
+/* accept into the queue of a listener used with accept_many */
+static void _accept_queue(lua_State* L, luv_object_t* self, luv_accept_t* acc) {
+  if (luvL_stream_accept_new(L, &self->h.stream, self->h.handle.type)) {
+    lua_rawgeti(L, LUA_REGISTRYINDEX, acc->aref);
+    lua_insert(L, -2);
+    lua_rawseti(L, -2, ++acc->atail);
+    lua_pop(L, 1);
+  }
+}
+
 static void _listen_cb(uv_stream_t* server, int status) {
   TRACE("got client connection...\n");
   luv_object_t* self = container_of(server, luv_object_t, h);
-  if (luvL_object_is_waiting(self)) {
+  luv_stream_io_t* io = (luv_stream_io_t*)self->data;
+
+  if (io && io->accept.handler != LUA_NOREF) {
+    /* spawn handler(conn) */
+    luv_thread_t* thread = (luv_thread_t*)server->loop->data;
+    lua_State* L = thread->L;
+    lua_rawgeti(L, LUA_REGISTRYINDEX, io->accept.handler);
+    if (luvL_stream_accept_new(L, &self->h.stream, self->h.handle.type)) {
+      luvL_fiber_ready(luvL_fiber_create((luv_state_t*)thread, 2));
+    }
+    lua_pop(L, 1); /* the fiber, or the handler */
+  }
+  else if (io && io->accept.aref != LUA_NOREF) {
+    luv_accept_t* acc = &io->accept;
+    luv_thread_t* thread = (luv_thread_t*)server->loop->data;
+    if (!luvL_object_is_waiting(self) && acc->atail - acc->ahead >= LUV_ACCEPT_BACKLOG) {
+      /* libuv stops polling the listener until accept_many catches up */
+      self->count++;
+      return;
+    }
+    _accept_queue(thread->L, self, acc);
+    if (luvL_object_is_waiting(self) && acc->atail > acc->ahead) {
+      ngx_queue_t* q = ngx_queue_head(&self->rouse);
+      luv_state_t* s = ngx_queue_data(q, luv_state_t, cond);
+      int max = (int)lua_tointeger(s->L, 2);
+      lua_settop(s->L, 0);
+      _accept_push(s->L, acc, max);
+      luvL_cond_signal(&self->rouse);
+      if (ngx_queue_empty(&self->rouse)) {
+        self->flags &= ~LUV_OWAITING;
+      }
+    }
+  }
+  else if (luvL_object_is_waiting(self)) {
     ngx_queue_t* q = ngx_queue_head(&self->rouse);
     luv_state_t* s = ngx_queue_data(q, luv_state_t, cond);
     lua_State* L = s->L;
@@ -113,6 +402,9 @@ static void _listen_cb(uv_stream_t* server, int status) {
       lua_pushnil(L);
       lua_pushstring(L, uv_strerror(err));
     }
+    else {
+      ((luv_thread_t*)server->loop->data)->accepted++;
+    }
     self->flags &= ~LUV_OWAITING;
     luvL_cond_signal(&self->rouse);
   }
@@ -121,11 +413,19 @@ static void _listen_cb(uv_stream_t* server, int status) {
     self->count++;
   }
 }
-
+/* stream:listen([backlog], [handler]), with a handler every connection
+** is accepted straight away and handler(conn) runs in a new fiber */
 static int luv_stream_listen(lua_State* L) {
   luaL_checktype(L, 1, LUA_TUSERDATA);
   luv_object_t* self = (luv_object_t*)lua_touserdata(L, 1);
   int backlog = luaL_optinteger(L, 2, 128);
+  if (!lua_isnoneornil(L, 3)) {
+    luv_accept_t* acc = &luvL_stream_io(self)->accept;
+    luaL_checktype(L, 3, LUA_TFUNCTION);
+    lua_pushvalue(L, 3);
+    luaL_unref(L, LUA_REGISTRYINDEX, acc->handler);
+    acc->handler = luaL_ref(L, LUA_REGISTRYINDEX);
+  }
   if (uv_listen(&self->h.stream, backlog, _listen_cb)) {
     uv_err_t err = uv_last_error(self->h.stream.loop);
     TRACE("listen error\n");
@@ -133,14 +433,18 @@ static int luv_stream_listen(lua_State* L) {
   }
   return 0;
 }
-
 static int luv_stream_accept(lua_State *L) {
   luaL_checktype(L, 1, LUA_TUSERDATA);
   luv_object_t* self = (luv_object_t*)lua_touserdata(L, 1);
   luv_object_t* conn = (luv_object_t*)lua_touserdata(L, 2);
+  luv_stream_io_t* io = (luv_stream_io_t*)self->data;
 
   luv_state_t* curr = luvL_state_self(L);
 
+  /* connections go to accept_many's queue and waiters from then on */
+  if (io && io->accept.aref != LUA_NOREF) {
+    return luaL_error(L, "accept: listener is used with accept_many");
+  }
   if (self->count) {
     self->count--;
     int rv = uv_accept(&self->h.stream, &conn->h.stream);
@@ -151,12 +455,45 @@ static int luv_stream_accept(lua_State *L) {
       lua_pushstring(L, uv_strerror(err));
       return 2;
     }
+    ((luv_thread_t*)self->h.handle.loop->data)->accepted++;
     return 1;
   }
   self->flags |= LUV_OWAITING;
   return luvL_cond_wait(&self->rouse, curr);
 }
 
+/* stream:accept_many([max]), returns a table of up to `max' connections,
+** waiting for at least one. From the first call on, connections are
+** accepted as they arrive and queued for the next call */
+static int luv_stream_accept_many(lua_State* L) {
+  luv_object_t* self = (luv_object_t*)lua_touserdata(L, 1);
+  luv_accept_t* acc  = &luvL_stream_io(self)->accept;
+  int max = luaL_optint(L, 2, LUV_ACCEPT_BACKLOG);
+  luaL_argcheck(L, max > 0, 2, "max must be positive");
+  lua_settop(L, 1);
+  lua_pushinteger(L, max);
+
+  if (acc->aref == LUA_NOREF) {
+    /* whoever waits on rouse now is in accept, not accept_many */
+    if (luvL_object_is_waiting(self)) {
+      return luaL_error(L, "accept_many: listener has fibers waiting in accept");
+    }
+    lua_newtable(L);
+    acc->aref = luaL_ref(L, LUA_REGISTRYINDEX);
+  }
+  if (self->count) {
+    /* reported by libuv before the last call, or while the queue was full */
+    self->count--;
+    _accept_queue(L, self, acc);
+  }
+  if (acc->atail == acc->ahead) {
+    self->flags |= LUV_OWAITING;
+    return luvL_cond_wait(&self->rouse, luvL_state_self(L));
+  }
+  _accept_push(L, acc, max);
+  return 1;
+}
+
 int luvL_stream_start(luv_object_t* self) {
   if (!luvL_object_is_started(self)) {
     self->flags |= LUV_OSTARTED;
@@ -203,28 +540,37 @@ static int luv_stream_stop(lua_State* L) {
   return 1;
 }
 
-static int luv_stream_read(lua_State* L) {
-  luv_object_t* self = (luv_object_t*)lua_touserdata(L, 1);
-  luv_state_t*  curr = luvL_state_self(L);
-  int len = luaL_optinteger(L, 2, 4096);
+/* serve a read of `kind' from the read-ahead buffer, or wait for it */
+static int _stream_read(lua_State* L, luv_object_t* self, int kind) {
+  luv_state_t* curr = luvL_state_self(L);
+  luv_rbuf_t*  rbuf = luvL_stream_rbuf(self);
+  int nret;
+
+  lua_settop(L, 2);
+  lua_pushinteger(L, kind);
+
+  /* readers are served in order */
+  if (ngx_queue_empty(&self->rouse)) {
+    nret = _rbuf_push(L, self, kind, 3);
+    if (nret) return nret;
+  }
+
+  if (luvL_stream_io(self)->splice) {
+    lua_settop(L, 0);
+    lua_pushnil(L);
+    lua_pushstring(L, "read: stream is being spliced");
+    return 2;
+  }
   if (luvL_object_is_closing(self)) {
     TRACE("error: reading from closed stream\n");
     lua_pushnil(L);
     lua_pushstring(L, "attempt to read from a closed stream");
     return 2;
   }
-  if (self->buf.base) {
-    /* we have a buffer use that */
-    TRACE("have pending data\n");
-    lua_pushinteger(L, self->count);
-    lua_pushlstring(L, (char*)self->buf.base, self->count);
-    free(self->buf.base);
-    self->buf.base = NULL;
-    self->buf.len  = 0;
-    self->count    = 0;
-    return 2;
+  if (rbuf->paused) {
+    /* the frame is larger than the high watermark */
+    rbuf->paused = 0;
   }
-  self->buf.len = len;
   if (!luvL_object_is_started(self)) {
     luvL_stream_start(self);
   }
@@ -232,28 +578,909 @@ static int luv_stream_read(lua_State* L) {
   return luvL_cond_wait(&self->rouse, curr);
 }
 
-static int luv_stream_write(lua_State* L) {
+static int luv_stream_read(lua_State* L) {
   luv_object_t* self = (luv_object_t*)lua_touserdata(L, 1);
+  luaL_optinteger(L, 2, 4096);
+  return _stream_read(L, self, LUV_READ_SOME);
+}
 
-  size_t len;
-  const char* chunk = luaL_checklstring(L, 2, &len);
+static int luv_stream_read_exact(lua_State* L) {
+  luv_object_t* self = (luv_object_t*)lua_touserdata(L, 1);
+  luaL_argcheck(L, luaL_checkinteger(L, 2) >= 0, 2, "length must not be negative");
+  return _stream_read(L, self, LUV_READ_EXACT);
+}
 
-  uv_buf_t buf = uv_buf_init((char*)chunk, len);
+static int luv_stream_read_until(lua_State* L) {
+  luv_object_t* self = (luv_object_t*)lua_touserdata(L, 1);
+  size_t dlen;
+  luaL_checklstring(L, 2, &dlen);
+  luaL_argcheck(L, dlen > 0, 2, "empty delimiter");
+  return _stream_read(L, self, LUV_READ_UNTIL);
+}
 
-  luv_state_t* curr = luvL_state_self(L);
-  uv_write_t*  req  = &curr->req.write;
+static int luv_stream_read_line(lua_State* L) {
+  luv_object_t* self = (luv_object_t*)lua_touserdata(L, 1);
+  return _stream_read(L, self, LUV_READ_LINE);
+}
+/* stream:read_into(buf), copy up to #buf buffered bytes into `buf'
+** without making a string, returns the count or nil at EOF */
+static int luv_stream_read_into(lua_State* L) {
+  luv_object_t* self = (luv_object_t*)lua_touserdata(L, 1);
+  luaL_checkudata(L, 2, LUV_BUFFER_T);
+  return _stream_read(L, self, LUV_READ_INTO);
+}
+
+/* stream:watermarks(high, low), set the read-ahead limits */
+static int luv_stream_watermarks(lua_State* L) {
+  luv_object_t* self = (luv_object_t*)lua_touserdata(L, 1);
+  luv_rbuf_t*   rbuf = luvL_stream_rbuf(self);
+  lua_Integer high = luaL_checkinteger(L, 2);
+  lua_Integer low  = luaL_optinteger(L, 3, high / 4);
+  luaL_argcheck(L, high > 0, 2, "high watermark must be positive");
+  luaL_argcheck(L, low >= 0 && low <= high, 3, "low watermark out of range");
+  rbuf->high = (size_t)high;
+  rbuf->low  = (size_t)low;
+  return 0;
+}
+
+/* most writes have few chunks, avoid a malloc for those */
+#define LUV_WRITEV_STACK 16
+
+/* push true, or false and the error of a failed queued write */
+static int _wqueue_result(lua_State* L, luv_wqueue_t* wq) {
+  if (wq->err.code != UV_OK) {
+    lua_pushboolean(L, 0);
+    lua_pushfstring(L, "write: %s", uv_strerror(wq->err));
+    wq->err.code = UV_OK;
+    return 2;
+  }
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+static void _wqueue_wake(ngx_queue_t* cond, luv_wqueue_t* wq) {
+  while (!ngx_queue_empty(cond)) {
+    ngx_queue_t* q = ngx_queue_head(cond);
+    luv_state_t* s = ngx_queue_data(q, luv_state_t, cond);
+    ngx_queue_remove(q);
+    lua_settop(s->L, 0);
+    _wqueue_result(s->L, wq);
+    luvL_state_ready(s);
+  }
+}
+
+/* corked streams queue like async ones, with the default limit if unset */
+#define _wqueue_limit(wq) ((wq)->limit ? (wq)->limit : LUV_WQUEUE_LIMIT)
 
-  if (uv_write(req, &self->h.stream, &buf, 1, _write_cb)) {
+static luv_wreq_t* _wreq_get(luv_wqueue_t* wq) {
+  luv_wreq_t* wreq = wq->free;
+  if (wreq) {
+    wq->free = wreq->next;
+  }
+  else {
+    wreq = (luv_wreq_t*)malloc(sizeof(luv_wreq_t));
+  }
+  wreq->ref   = LUA_NOREF;
+  wreq->block = NULL;
+  return wreq;
+}
+
+static void _wreq_put(lua_State* L, luv_wqueue_t* wq, luv_wreq_t* wreq) {
+  luaL_unref(L, LUA_REGISTRYINDEX, wreq->ref);
+  free(wreq->block);
+  wreq->next = wq->free;
+  wq->free   = wreq;
+}
+
+/* queued and corked writes don't suspend the writer, so the stream at
+** `idx' is kept from being collected, along with its io, until they are
+** done */
+static void _wqueue_anchor(lua_State* L, luv_wqueue_t* wq, int idx) {
+  if (wq->sref == LUA_NOREF) {
+    lua_pushvalue(L, idx);
+    wq->sref = luaL_ref(L, LUA_REGISTRYINDEX);
+  }
+}
+
+/* once nothing is pending. The stream may be collected as soon as
+** this returns, so it must be the last thing done with it */
+static void _wqueue_release(lua_State* L, luv_wqueue_t* wq) {
+  if (!wq->active && !wq->ncork && wq->sref != LUA_NOREF) {
+    int ref = wq->sref;
+    wq->sref = LUA_NOREF;
+    luaL_unref(L, LUA_REGISTRYINDEX, ref);
+  }
+}
+
+static void _write_async_cb(uv_write_t* req, int status) {
+  luv_wreq_t*   wreq = container_of(req, luv_wreq_t, req);
+  luv_object_t* self = container_of(req->handle, luv_object_t, h);
+  luv_wqueue_t* wq   = luvL_stream_wqueue(self);
+  luv_thread_t* thread = (luv_thread_t*)req->handle->loop->data;
+
+  _wreq_put(thread->L, wq, wreq);
+  wq->active--;
+
+  if (status && wq->err.code == UV_OK) {
+    wq->err = uv_last_error(req->handle->loop);
+  }
+  if (self->h.stream.write_queue_size <= _wqueue_limit(wq)) {
+    _wqueue_wake(&wq->drain, wq);
+  }
+  if (!wq->active) {
+    _wqueue_wake(&wq->flush, wq);
+  }
+  _wqueue_release(thread->L, wq);
+}
+
+static void _cork_cb(uv_check_t* handle, int status);
+
+static void _cork_unlink(luv_thread_t* thread, luv_stream_io_t* io) {
+  ngx_queue_remove(&io->corked);
+  ngx_queue_init(&io->corked);
+  if (ngx_queue_empty(&thread->corked)) {
+    uv_check_stop(&thread->check);
+  }
+}
+
+/* forget corked chunks that were never written, on close */
+static void _cork_drop(luv_object_t* self) {
+  luv_stream_io_t* io = (luv_stream_io_t*)self->data;
+  if (io && io->wqueue.ncork) {
+    luv_thread_t* thread = (luv_thread_t*)self->h.handle.loop->data;
+    luaL_unref(thread->L, LUA_REGISTRYINDEX, io->wqueue.cref);
+    io->wqueue.cref   = LUA_NOREF;
+    io->wqueue.ncork  = 0;
+    io->wqueue.cbytes = 0;
+    _cork_unlink(thread, io);
+    _wqueue_release(thread->L, &io->wqueue);
+  }
+}
+
+/* write all corked chunks with a single uv_write. Returns -1 if the
+** write couldn't be started, the error is then reported by the next
+** write or flush */
+static int _cork_flush(lua_State* L, luv_object_t* self) {
+  luv_stream_io_t* io = luvL_stream_io(self);
+  luv_wqueue_t*    wq = &io->wqueue;
+  luv_thread_t* thread = (luv_thread_t*)self->h.handle.loop->data;
+  luv_wreq_t* wreq;
+
+  uv_buf_t  stack[LUV_WRITEV_STACK];
+  uv_buf_t* bufs = stack;
+  int i, n = wq->ncork, rv;
+
+  if (!n) return 0;
+  if (luvL_object_is_closing(self)) {
+    _cork_drop(self);
+    return 0;
+  }
+  _cork_unlink(thread, io);
+
+  if (n > LUV_WRITEV_STACK) {
+    bufs = (uv_buf_t*)malloc(n * sizeof(uv_buf_t));
+  }
+  lua_rawgeti(L, LUA_REGISTRYINDEX, wq->cref);
+  for (i = 0; i < n; i++) {
+    size_t len;
+    const char* chunk;
+    lua_rawgeti(L, -1, i + 1);
+    chunk = lua_tolstring(L, -1, &len);
+    lua_pop(L, 1); /* still referenced by the table */
+    bufs[i] = uv_buf_init((char*)chunk, len);
+  }
+  lua_pop(L, 1);
+
+  /* the chunk table now belongs to the request */
+  wreq = _wreq_get(wq);
+  wreq->ref  = wq->cref;
+  wq->cref   = LUA_NOREF;
+  wq->ncork  = 0;
+  wq->cbytes = 0;
+
+  rv = uv_write(&wreq->req, &self->h.stream, bufs, n, _write_async_cb);
+  if (bufs != stack) free(bufs);
+
+  if (rv) {
+    if (wq->err.code == UV_OK) {
+      wq->err = uv_last_error(self->h.handle.loop);
+    }
+    _wreq_put(L, wq, wreq);
+    _wqueue_release(L, wq);
+    return -1;
+  }
+  wq->active++;
+  return 0;
+}
+
+/* end of the loop iteration, write out everything corked during it */
+static void _cork_cb(uv_check_t* handle, int status) {
+  luv_thread_t* thread = container_of(handle, luv_thread_t, check);
+  (void)status;
+  while (!ngx_queue_empty(&thread->corked)) {
+    ngx_queue_t* q = ngx_queue_head(&thread->corked);
+    luv_stream_io_t* io = ngx_queue_data(q, luv_stream_io_t, corked);
+    _cork_flush(thread->L, io->object);
+  }
+}
+
+/* append the chunks to the stream's corked writes. They go out in one
+** write at the end of the loop iteration, or as soon as there are too
+** many of them */
+static int _stream_cork(lua_State* L, luv_object_t* self, int base, int table, int n) {
+  luv_stream_io_t* io = luvL_stream_io(self);
+  luv_wqueue_t*    wq = &io->wqueue;
+  int i;
+
+  /* check every chunk first, a message is corked whole or not at all */
+  for (i = 0; i < n; i++) {
+    if (table) {
+      lua_rawgeti(L, base, i + 1);
+      if (lua_type(L, -1) != LUA_TSTRING) {
+        return luaL_error(L, "writev: chunk %d is not a string", i + 1);
+      }
+      lua_pop(L, 1);
+    }
+    else {
+      luaL_checkstring(L, base + i);
+    }
+  }
+
+  if (wq->cref == LUA_NOREF) {
+    lua_newtable(L);
+    wq->cref = luaL_ref(L, LUA_REGISTRYINDEX);
+  }
+  _wqueue_anchor(L, wq, 1);
+  lua_rawgeti(L, LUA_REGISTRYINDEX, wq->cref);
+  for (i = 0; i < n; i++) {
+    size_t len;
+    if (table) {
+      lua_rawgeti(L, base, i + 1);
+    }
+    else {
+      lua_pushvalue(L, base + i);
+    }
+    lua_tolstring(L, -1, &len);
+    lua_rawseti(L, -2, ++wq->ncork);
+    wq->cbytes += len;
+  }
+  lua_pop(L, 1);
+
+  if (wq->ncork && ngx_queue_empty(&io->corked)) {
+    luv_thread_t* thread = (luv_thread_t*)self->h.handle.loop->data;
+    if (ngx_queue_empty(&thread->corked)) {
+      uv_check_start(&thread->check, _cork_cb);
+      /* don't let the loop block in poll before the check runs */
+      uv_async_send(&thread->async);
+    }
+    ngx_queue_insert_tail(&thread->corked, &io->corked);
+  }
+
+  if (wq->ncork >= LUV_CORK_IOV || wq->cbytes >= _wqueue_limit(wq)) {
+    if (_cork_flush(L, self)) {
+      return _wqueue_result(L, wq);
+    }
+    if (self->h.stream.write_queue_size > _wqueue_limit(wq)) {
+      return luvL_cond_wait(&wq->drain, luvL_state_self(L));
+    }
+  }
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+/* write the strings at stack indices `base' and up, or the strings in
+** the table at `base', with a single uv_write. Until _write_cb they stay
+** anchored on the caller's stack, or in the registry for queued writes */
+static int _stream_writev(lua_State* L, luv_object_t* self, int base, int table) {
+  luv_state_t*  curr = luvL_state_self(L);
+  luv_wqueue_t* wq   = luvL_stream_wqueue(self);
+  luv_wreq_t*   wreq = NULL;
+  uv_write_t*   req  = &curr->req.write;
+
+  uv_buf_t  stack[LUV_WRITEV_STACK];
+  uv_buf_t* bufs = stack;
+  size_t    len;
+  int i, n, rv;
+
+  if (wq->err.code != UV_OK) {
+    return _wqueue_result(L, wq);
+  }
+
+  n = table ? (int)lua_objlen(L, base) : lua_gettop(L) - base + 1;
+  if (wq->cork) {
+    return _stream_cork(L, self, base, table, n);
+  }
+  if (n > LUV_WRITEV_STACK) {
+    bufs = (uv_buf_t*)malloc(n * sizeof(uv_buf_t));
+  }
+  for (i = 0; i < n; i++) {
+    const char* chunk;
+    if (table) {
+      lua_rawgeti(L, base, i + 1);
+      if (lua_type(L, -1) != LUA_TSTRING) {
+        if (bufs != stack) free(bufs);
+        return luaL_error(L, "writev: chunk %d is not a string", i + 1);
+      }
+      chunk = lua_tolstring(L, -1, &len);
+      lua_pop(L, 1); /* still referenced by the table */
+    }
+    else {
+      chunk = luaL_checklstring(L, base + i, &len);
+    }
+    bufs[i] = uv_buf_init((char*)chunk, len);
+  }
+
+  if (wq->limit) {
+    wreq = _wreq_get(wq);
+    if (!table && n == 1) {
+      lua_pushvalue(L, base);
+    }
+    else {
+      /* the caller may reuse its own table as soon as we return */
+      lua_createtable(L, n, 0);
+      for (i = 0; i < n; i++) {
+        if (table) {
+          lua_rawgeti(L, base, i + 1);
+        }
+        else {
+          lua_pushvalue(L, base + i);
+        }
+        lua_rawseti(L, -2, i + 1);
+      }
+    }
+    wreq->ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    req = &wreq->req;
+  }
+
+  /* uv_write copies the uv_buf_t array itself */
+  rv = uv_write(req, &self->h.stream, bufs, n, wreq ? _write_async_cb : _write_cb);
+  if (bufs != stack) free(bufs);
+
+  if (rv) {
+    if (wreq) {
+      _wreq_put(L, wq, wreq);
+    }
     luvL_stream_stop(self);
     luvL_object_close(self);
     STREAM_ERROR(L, "write: %s", luvL_event_loop(L));
     return 2;
   }
 
-  lua_settop(curr->L, 1);
+  if (wreq) {
+    wq->active++;
+    _wqueue_anchor(L, wq, 1);
+    if (self->h.stream.write_queue_size > wq->limit) {
+      TRACE("write queue over limit, waiting\n");
+      return luvL_cond_wait(&wq->drain, curr);
+    }
+    lua_pushboolean(L, 1);
+    return 1;
+  }
   return luvL_state_suspend(curr);
 }
 
+/* stream:write(chunk1, ..., chunkN) */
+static int luv_stream_write(lua_State* L) {
+  luv_object_t* self = (luv_object_t*)lua_touserdata(L, 1);
+  luaL_checkstring(L, 2);
+  return _stream_writev(L, self, 2, 0);
+}
+
+/* stream:writev{ chunk1, ..., chunkN } */
+static int luv_stream_writev(lua_State* L) {
+  luv_object_t* self = (luv_object_t*)lua_touserdata(L, 1);
+  if (lua_istable(L, 2)) {
+    lua_settop(L, 2);
+    return _stream_writev(L, self, 2, 1);
+  }
+  return _stream_writev(L, self, 2, 0);
+}
+
+/* the write request adopts the encode buffer */
+typedef struct luv_value_sink_s {
+  uv_buf_t buf;
+  void*    block;
+} luv_value_sink_t;
+
+static int _value_sink_take(luv_sink_t* sink, char* data, size_t len, void* block) {
+  luv_value_sink_t* vs = (luv_value_sink_t*)sink->data;
+  vs->buf   = uv_buf_init(data, len);
+  vs->block = block;
+  return 0;
+}
+
+/* stream:write_value(...), encode the values with luv.codec straight
+** into the buffer which is written, for a luv.codec.decoder on the other
+** end. Returns like write, once the write completes or, with async, once
+** it's queued */
+static int luv_stream_write_value(lua_State* L) {
+  luv_object_t* self = (luv_object_t*)lua_touserdata(L, 1);
+  luv_wqueue_t* wq   = luvL_stream_wqueue(self);
+  luv_value_sink_t vs;
+  luv_sink_t  sink;
+  luv_wreq_t* wreq;
+
+  if (wq->err.code != UV_OK) {
+    return _wqueue_result(L, wq);
+  }
+  if (wq->cork) {
+    /* corked chunks are Lua strings in the cork table */
+    luvL_codec_encode(L, lua_gettop(L) - 1);
+    return _stream_writev(L, self, lua_gettop(L), 0);
+  }
+
+  sink.write = NULL;
+  sink.take  = _value_sink_take;
+  sink.flags = 0;
+  sink.data  = &vs;
+  luvL_codec_encode_into(L, lua_gettop(L) - 1, &sink);
+
+  wreq = _wreq_get(wq);
+  wreq->block = vs.block;
+  if (uv_write(&wreq->req, &self->h.stream, &vs.buf, 1, _write_async_cb)) {
+    _wreq_put(L, wq, wreq);
+    luvL_stream_stop(self);
+    luvL_object_close(self);
+    STREAM_ERROR(L, "write: %s", luvL_event_loop(L));
+    return 2;
+  }
+  wq->active++;
+  _wqueue_anchor(L, wq, 1);
+
+  if (!wq->limit) {
+    /* wait like write does, along with anything flushed before it */
+    return luvL_cond_wait(&wq->flush, luvL_state_self(L));
+  }
+  if (self->h.stream.write_queue_size > wq->limit) {
+    return luvL_cond_wait(&wq->drain, luvL_state_self(L));
+  }
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+/* stream:async([limit]), queue writes and only suspend once more than
+** `limit' bytes are unsent. stream:async(false) turns it off again */
+static int luv_stream_async(lua_State* L) {
+  luv_object_t* self = (luv_object_t*)lua_touserdata(L, 1);
+  luv_wqueue_t* wq   = luvL_stream_wqueue(self);
+  if (lua_isboolean(L, 2) && !lua_toboolean(L, 2)) {
+    wq->limit = 0;
+  }
+  else {
+    lua_Integer limit = luaL_optinteger(L, 2, LUV_WQUEUE_LIMIT);
+    luaL_argcheck(L, limit > 0, 2, "limit must be positive");
+    wq->limit = (size_t)limit;
+  }
+  return 0;
+}
+
+/* stream:cork(on), gather writes and send them together at the end of
+** the loop iteration. stream:cork(false) writes out what's gathered */
+static int luv_stream_cork(lua_State* L) {
+  luv_object_t* self = (luv_object_t*)lua_touserdata(L, 1);
+  luv_wqueue_t* wq   = luvL_stream_wqueue(self);
+  wq->cork = lua_isnone(L, 2) || lua_toboolean(L, 2);
+  if (!wq->cork && _cork_flush(L, self)) {
+    return _wqueue_result(L, wq);
+  }
+  return 0;
+}
+
+/* stream:flush(), wait for all queued writes to complete */
+static int luv_stream_flush(lua_State* L) {
+  luv_object_t* self = (luv_object_t*)lua_touserdata(L, 1);
+  luv_wqueue_t* wq   = luvL_stream_wqueue(self);
+  _cork_flush(L, self);
+  if (wq->active) {
+    return luvL_cond_wait(&wq->flush, luvL_state_self(L));
+  }
+  return _wqueue_result(L, wq);
+}
+
+/* a write of data read by a splice, `buf' goes back to the pool */
+typedef struct luv_splice_req_s {
+  uv_write_t    req;
+  uv_buf_t      buf;
+  size_t        len;
+  luv_splice_t* splice;
+} luv_splice_req_t;
+
+/* push the results of a splice onto `L' and free it */
+static int _splice_result(lua_State* L, luv_splice_t* sp) {
+  int nret = 1;
+  luvL_stream_io(sp->src)->splice = NULL;
+  lua_settop(L, 0);
+  lua_pushnumber(L, (lua_Number)sp->bytes);
+  if (sp->err.code != UV_OK) {
+    lua_pushfstring(L, "splice: %s", uv_strerror(sp->err));
+    nret = 2;
+  }
+  free(sp);
+  return nret;
+}
+
+static void _splice_finish(luv_splice_t* sp) {
+  luv_state_t* s = sp->state;
+  _splice_result(s->L, sp);
+  luvL_state_ready(s);
+}
+
+static uv_err_t _splice_eof(void) {
+  uv_err_t err;
+  memset(&err, 0, sizeof(err));
+  err.code = UV_EOF;
+  return err;
+}
+
+static void _splice_end(luv_splice_t* sp, uv_err_t err) {
+  if (sp->err.code == UV_OK && err.code != UV_EOF) {
+    sp->err = err;
+  }
+  sp->done = 1;
+  luvL_stream_stop(sp->src);
+  if (!sp->pending && sp->state) {
+    _splice_finish(sp);
+  }
+}
+
+static void _splice_write_cb(uv_write_t* req, int status) {
+  luv_splice_req_t* wr = container_of(req, luv_splice_req_t, req);
+  luv_splice_t*     sp = wr->splice;
+  uv_loop_t*      loop = req->handle->loop;
+
+  luvL_pool_release(luvL_pool_self(loop), wr->buf);
+  sp->pending--;
+  if (!status) sp->bytes += wr->len;
+  free(wr);
+
+  if (status) {
+    _splice_end(sp, uv_last_error(loop));
+    return;
+  }
+  if (sp->done) {
+    if (!sp->pending) _splice_finish(sp);
+    return;
+  }
+  if (sp->paused && sp->dst->h.stream.write_queue_size
+      <= _wqueue_limit(luvL_stream_wqueue(sp->dst)) / 2) {
+    sp->paused = 0;
+    luvL_stream_start(sp->src);
+  }
+}
+
+/* write `len' bytes of the pooled `buf' to the destination */
+static void _splice_write(luv_splice_t* sp, uv_buf_t buf, size_t len) {
+  luv_splice_req_t* wr = (luv_splice_req_t*)malloc(sizeof(luv_splice_req_t));
+  uv_buf_t data = uv_buf_init(buf.base, len);
+  wr->buf    = buf;
+  wr->len    = len;
+  wr->splice = sp;
+  if (uv_write(&wr->req, &sp->dst->h.stream, &data, 1, _splice_write_cb)) {
+    luvL_pool_release(luvL_pool_self(sp->dst->h.handle.loop), buf);
+    free(wr);
+    _splice_end(sp, uv_last_error(sp->dst->h.handle.loop));
+    return;
+  }
+  sp->pending++;
+  if (sp->dst->h.stream.write_queue_size > _wqueue_limit(luvL_stream_wqueue(sp->dst))) {
+    TRACE("splice destination is backed up, stop reading\n");
+    sp->paused = 1;
+    luvL_stream_stop(sp->src);
+  }
+}
+
+/* read callback of a splice source, the read buffer is written as is */
+static void _splice_read(luv_object_t* self, ssize_t len, uv_buf_t buf) {
+  luv_splice_t* sp = luvL_stream_io(self)->splice;
+  if (len > 0 && !sp->done) {
+    _splice_write(sp, buf, (size_t)len);
+    return;
+  }
+  luvL_pool_release(luvL_pool_self(self->h.handle.loop), buf);
+  if (len < 0) {
+    /* leave the source in the state a plain read would */
+    luv_rbuf_t* rbuf = luvL_stream_rbuf(self);
+    uv_err_t     err = uv_last_error(self->h.handle.loop);
+    _splice_end(sp, err);
+    if (err.code == UV_EOF) {
+      rbuf->eof = 1;
+    }
+    else {
+      rbuf->err = err;
+      luvL_object_close(self);
+    }
+    _rbuf_wake(self);
+  }
+}
+
+/* tcp and pipe objects, which have the stream methods */
+static luv_object_t* _stream_check(lua_State* L, int idx) {
+  void* self = lua_touserdata(L, idx);
+  int ok = 0;
+  if (self && lua_getmetatable(L, idx)) {
+    luaL_getmetatable(L, LUV_NET_TCP_T);
+    luaL_getmetatable(L, LUV_PIPE_T);
+    ok = lua_rawequal(L, -1, -3) || lua_rawequal(L, -2, -3);
+    lua_pop(L, 3);
+  }
+  if (!ok) luaL_typerror(L, idx, "stream");
+  return (luv_object_t*)self;
+}
+
+/* luv.stream.splice(src, dst), forward everything read from `src' to
+** `dst' until `src' ends or an error. Returns the number of bytes moved
+** and, after an error, the error message */
+static int luv_stream_splice(lua_State* L) {
+  luv_object_t* src = _stream_check(L, 1);
+  luv_object_t* dst = _stream_check(L, 2);
+  luv_rbuf_t*  rbuf;
+  luv_splice_t*  sp;
+
+  luaL_argcheck(L, dst != src, 2, "cannot splice a stream to itself");
+  if (luvL_stream_io(src)->splice) {
+    return luaL_error(L, "splice: source is already being spliced");
+  }
+  if (!ngx_queue_empty(&src->rouse)) {
+    return luaL_error(L, "splice: source has waiting readers");
+  }
+  lua_settop(L, 2); /* keep both streams alive */
+
+  /* no state to wake until we suspend */
+  sp = (luv_splice_t*)calloc(1, sizeof(luv_splice_t));
+  sp->src = src;
+  sp->dst = dst;
+  luvL_stream_io(src)->splice = sp;
+
+  /* anything corked for dst goes first */
+  _cork_flush(L, dst);
+
+  /* then what src had already read ahead */
+  rbuf = luvL_stream_rbuf(src);
+  if (rbuf->wpos > rbuf->rpos) {
+    size_t used = rbuf->wpos - rbuf->rpos;
+    uv_buf_t buf = luvL_pool_alloc(luvL_pool_self(src->h.handle.loop), used);
+    memcpy(buf.base, rbuf->base + rbuf->rpos, used);
+    _rbuf_consume(src, rbuf, used);
+    _splice_write(sp, buf, used);
+  }
+  rbuf->paused = 0;
+
+  if (rbuf->err.code != UV_OK) {
+    _splice_end(sp, rbuf->err);
+  }
+  else if (rbuf->eof || luvL_object_is_closing(src)) {
+    _splice_end(sp, _splice_eof());
+  }
+  else if (!sp->done && !sp->paused) {
+    luvL_stream_start(src);
+  }
+  if (sp->done && !sp->pending) {
+    return _splice_result(L, sp);
+  }
+  sp->state = luvL_state_self(L);
+  return luvL_state_suspend(sp->state);
+}
+
+#ifndef WIN32
+#define LUV_SENDFILE_CHUNK (64 * 1024)
+
+/* one sendfile(2) call from `fd' at `offset' to the socket `sock'.
+** Returns the bytes sent, 0 at the end of the file or -1 with errno */
+static ssize_t _sendfile_once(int sock, int fd, int64_t offset, size_t len) {
+#if defined(__linux__)
+  off_t off = (off_t)offset;
+  return sendfile(sock, fd, &off, len);
+#elif defined(__APPLE__)
+  off_t sent = (off_t)len;
+  if (sendfile(fd, sock, (off_t)offset, &sent, NULL, 0) && !sent) return -1;
+  return (ssize_t)sent;
+#elif defined(__FreeBSD__)
+  off_t sent = 0;
+  if (sendfile(fd, sock, (off_t)offset, len, NULL, &sent, 0) && !sent) return -1;
+  return (ssize_t)sent;
+#else
+  (void)sock; (void)fd; (void)offset; (void)len;
+  errno = ENOSYS;
+  return -1;
+#endif
+}
+
+/* send until the socket is full, the range is done or an error.
+** Returns 1 when the transfer is over */
+static int _sendfile_pump(luv_sendfile_t* sf) {
+  int sock = sf->stream->h.stream.fd;
+  while (sf->left) {
+    ssize_t n = _sendfile_once(sock, sf->fd, sf->offset, sf->left);
+    if (n > 0) {
+      sf->offset += n;
+      sf->left   -= (size_t)n;
+      sf->bytes  += (size_t)n;
+    }
+    else if (n == 0) {
+      break; /* the file is shorter than the range */
+    }
+    else if (errno == EINTR) {
+      continue;
+    }
+    else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+      return 0;
+    }
+    else {
+      sf->err = errno;
+      break;
+    }
+  }
+  return 1;
+}
+
+static int _sendfile_result(lua_State* L, luv_sendfile_t* sf) {
+  lua_settop(L, 0);
+  lua_pushnumber(L, (lua_Number)sf->bytes);
+  if (sf->err) {
+    lua_pushfstring(L, "sendfile: %s", strerror(sf->err));
+    return 2;
+  }
+  return 1;
+}
+
+static void _sendfile_finish(luv_sendfile_t* sf) {
+  luv_state_t* s = sf->state;
+  luvL_stream_io(sf->stream)->sendfile = NULL;
+  _sendfile_result(s->L, sf);
+  free(sf);
+  luvL_state_ready(s);
+}
+
+static void _sendfile_write_cb(uv_write_t* req, int status);
+
+/* the socket is full, so read the next chunk of the file and queue it
+** as a plain write: libuv sends it once the socket drains, and its
+** callback resumes sendfile(2). Returns 1 when the transfer is over */
+static int _sendfile_queue(luv_sendfile_t* sf) {
+  uv_loop_t* loop = sf->stream->h.handle.loop;
+  size_t len = sf->left < LUV_SENDFILE_CHUNK ? sf->left : LUV_SENDFILE_CHUNK;
+  uv_buf_t data;
+  ssize_t n;
+
+  sf->buf = luvL_pool_alloc(luvL_pool_self(loop), len);
+  do {
+    n = pread(sf->fd, sf->buf.base, len, (off_t)sf->offset);
+  } while (n < 0 && errno == EINTR);
+  if (n <= 0) {
+    if (n < 0) sf->err = errno;
+    luvL_pool_release(luvL_pool_self(loop), sf->buf);
+    return 1;
+  }
+  data = uv_buf_init(sf->buf.base, (size_t)n);
+  if (uv_write(&sf->req, &sf->stream->h.stream, &data, 1, _sendfile_write_cb)) {
+    uv_err_t err = uv_last_error(loop);
+    sf->err = err.sys_errno_ ? err.sys_errno_ : EIO;
+    luvL_pool_release(luvL_pool_self(loop), sf->buf);
+    return 1;
+  }
+  sf->len     = (size_t)n;
+  sf->offset += n;
+  sf->left   -= (size_t)n;
+  return 0;
+}
+
+/* continue the transfer, returns 1 when it is over */
+static int _sendfile_next(luv_sendfile_t* sf) {
+  /* writes queued before the sendfile must reach the socket first */
+  if (!sf->stream->h.stream.write_queue_size && _sendfile_pump(sf)) {
+    return 1;
+  }
+  return _sendfile_queue(sf);
+}
+
+static void _sendfile_write_cb(uv_write_t* req, int status) {
+  luv_sendfile_t* sf = container_of(req, luv_sendfile_t, req);
+  uv_loop_t*    loop = req->handle->loop;
+
+  luvL_pool_release(luvL_pool_self(loop), sf->buf);
+  if (status) {
+    if (!sf->err) {
+      uv_err_t err = uv_last_error(loop);
+      sf->err = err.sys_errno_ ? err.sys_errno_ : EIO;
+    }
+    _sendfile_finish(sf);
+    return;
+  }
+  sf->bytes += sf->len;
+  if (luvL_object_is_closing(sf->stream)) {
+    sf->err = ECANCELED;
+  }
+  if (sf->err || !sf->left || _sendfile_next(sf)) {
+    _sendfile_finish(sf);
+  }
+}
+
+/* stream:sendfile(file, [offset], [length]), send `length' bytes of
+** `file' from `offset' straight from the page cache to the socket.
+** Length defaults to the rest of the file. Returns the bytes sent and,
+** after an error, the error message */
+static int luv_stream_sendfile(lua_State* L) {
+  luv_object_t* self = (luv_object_t*)lua_touserdata(L, 1);
+  luv_object_t* file = (luv_object_t*)luaL_checkudata(L, 2, LUV_FILE_T);
+  int64_t  offset = (int64_t)luaL_optnumber(L, 3, 0);
+  luv_stream_io_t* io = luvL_stream_io(self);
+  luv_sendfile_t   sync, *sf = &sync;
+
+  luaL_argcheck(L, offset >= 0, 3, "offset must not be negative");
+  if (file->h.file < 0) {
+    return luaL_error(L, "sendfile: file is not open");
+  }
+  if (io->sendfile) {
+    return luaL_error(L, "sendfile: already in progress");
+  }
+  if (luvL_object_is_closing(self)) {
+    return luaL_error(L, "sendfile: stream is closed");
+  }
+
+  memset(sf, 0, sizeof(luv_sendfile_t));
+  sf->stream = self;
+  sf->fd     = file->h.file;
+  sf->offset = offset;
+  if (lua_isnoneornil(L, 4)) {
+    struct stat st;
+    if (fstat(sf->fd, &st)) {
+      sf->err = errno;
+      return _sendfile_result(L, sf);
+    }
+    sf->left = st.st_size > offset ? (size_t)(st.st_size - offset) : 0;
+  }
+  else {
+    lua_Number len = luaL_checknumber(L, 4);
+    luaL_argcheck(L, len >= 0, 4, "length must not be negative");
+    sf->left = (size_t)len;
+  }
+  lua_settop(L, 2); /* keep the stream and file alive */
+
+  _cork_flush(L, self);
+
+  /* most of a small file usually fits in the socket buffer */
+  if (!self->h.stream.write_queue_size && _sendfile_pump(sf)) {
+    return _sendfile_result(L, sf);
+  }
+
+  /* wait for the socket to drain behind a chunk in the stream's write
+  ** queue, libuv allows only the stream's own watcher on its fd */
+  sf = (luv_sendfile_t*)malloc(sizeof(luv_sendfile_t));
+  memcpy(sf, &sync, sizeof(luv_sendfile_t));
+  if (_sendfile_queue(sf)) {
+    int nret = _sendfile_result(L, sf);
+    free(sf);
+    return nret;
+  }
+  sf->state = luvL_state_self(L);
+  io->sendfile = sf;
+  return luvL_state_suspend(sf->state);
+}
+#endif /* WIN32 */
+
+/* whether an idle connection can still be used: it isn't closing, has
+** nothing buffered and its socket isn't readable, which would mean EOF,
+** an error or data nobody asked for */
+int luvL_stream_alive(luv_object_t* self) {
+  if (luvL_object_is_closing(self)) return 0;
+  if (self->data) {
+    luv_rbuf_t* rbuf = luvL_stream_rbuf(self);
+    if (rbuf->eof || rbuf->err.code != UV_OK || rbuf->wpos > rbuf->rpos) return 0;
+  }
+#ifndef WIN32
+  {
+    char c;
+    ssize_t n;
+    if (self->h.stream.fd < 0) return 0;
+    do {
+      n = recv(self->h.stream.fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+    } while (n < 0 && errno == EINTR);
+    if (n >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) return 0;
+  }
+#endif
+  return 1;
+}
+
 static int luv_stream_shutdown(lua_State* L) {
   luv_object_t* self = (luv_object_t*)lua_touserdata(L, 1);
   if (!luvL_object_is_shutdown(self)) {
@@ -282,10 +1509,17 @@ void luvL_stream_close(luv_object_t* self) {
     luvL_stream_stop(self);
   }
   luvL_object_close(self);
-  if (self->buf.base) {
-    free(self->buf.base);
-    self->buf.base = NULL;
-    self->buf.len  = 0;
+  if (self->data) {
+    /* queued writes still complete, so only drop buffered input and
+    ** corked writes that never started */
+    luv_rbuf_t* rbuf = luvL_stream_rbuf(self);
+    _cork_drop(self);
+    if (luvL_stream_io(self)->splice) {
+      _splice_end(luvL_stream_io(self)->splice, _splice_eof());
+    }
+    free(rbuf->base);
+    rbuf->base = NULL;
+    rbuf->size = rbuf->rpos = rbuf->wpos = 0;
   }
 }
 
@@ -298,11 +1532,7 @@ static int luv_stream_close(lua_State* L) {
 void luvL_stream_free(luv_object_t* self) {
   luvL_object_close(self);
   TRACE("free stream: %p\n", self);
-  if (self->buf.base) {
-    free(self->buf.base);
-    self->buf.base = NULL;
-    self->buf.len  = 0;
-  }
+  _stream_io_free(self);
 }
 
 static int luv_stream_free(lua_State* L) {
@@ -317,15 +1547,36 @@ static int luv_stream_tostring(lua_State* L) {
   return 1;
 }
 
+luaL_Reg luv_stream_funcs[] = {
+  {"splice",    luv_stream_splice},
+  {NULL,        NULL}
+};
+
 luaL_Reg luv_stream_meths[] = {
   {"read",      luv_stream_read},
+  {"read_exact",luv_stream_read_exact},
+  {"read_until",luv_stream_read_until},
+  {"read_line", luv_stream_read_line},
+  {"read_into", luv_stream_read_into},
   {"readable",  luv_stream_readable},
   {"write",     luv_stream_write},
+  {"writev",    luv_stream_writev},
+  {"write_value",luv_stream_write_value},
+  {"async",     luv_stream_async},
+  {"cork",      luv_stream_cork},
+  {"flush",     luv_stream_flush},
+#ifndef WIN32
+  {"sendfile",  luv_stream_sendfile},
+  {"setsockopt",luvL_net_setsockopt},
+  {"getsockopt",luvL_net_getsockopt},
+#endif
   {"writable",  luv_stream_writable},
+  {"watermarks",luv_stream_watermarks},
   {"start",     luv_stream_start},
   {"stop",      luv_stream_stop},
   {"listen",    luv_stream_listen},
   {"accept",    luv_stream_accept},
+  {"accept_many",luv_stream_accept_many},
   {"shutdown",  luv_stream_shutdown},
   {"close",     luv_stream_close},
   {"__gc",      luv_stream_free},
@@ -1,5 +1,10 @@
 #include "luv.h"
 
+#ifndef WIN32
+#include <unistd.h>
+#include <sys/socket.h>
+#endif
+
 void luvL_thread_ready(luv_thread_t* self) {
   if (!(self->flags & LUV_FREADY)) {
     TRACE("SET READY\n");
@@ -169,6 +174,94 @@ static void _async_cb(uv_async_t* handle, int status) {
   (void)status;
 }
 
+/* create the socket pair a spawned thread receives handles over */
+static void _ipc_init(luv_ipc_t* ipc, int pair) {
+  memset(ipc, 0, sizeof(luv_ipc_t));
+  ipc->fd[0] = ipc->fd[1] = -1;
+  ipc->ref = LUA_NOREF;
+  ngx_queue_init(&ipc->wait);
+#ifndef WIN32
+  if (pair && socketpair(AF_UNIX, SOCK_STREAM, 0, ipc->fd)) {
+    ipc->fd[0] = ipc->fd[1] = -1;
+  }
+#else
+  (void)pair;
+#endif
+}
+
+static void _ipc_close_cb(uv_handle_t* handle) {
+  free(handle);
+}
+
+/* at thread exit, close the receiving end in the thread's own loop,
+** which then has to go around once more for the close callback */
+static void _ipc_close_recv(luv_thread_t* self) {
+  if (self->ipc.recv) {
+    uv_close((uv_handle_t*)self->ipc.recv, _ipc_close_cb);
+    self->ipc.recv  = NULL;
+    self->ipc.fd[1] = -1; /* closed with the pipe */
+    /* don't block in poll on whatever else is still open */
+    uv_async_send(&self->async);
+    uv_run_once(self->loop);
+  }
+}
+
+static uv_buf_t _ipc_alloc_cb(uv_handle_t* handle, size_t size) {
+  luv_thread_t* self = (luv_thread_t*)handle->data;
+  (void)size;
+  return uv_buf_init(self->ipc.buf, sizeof(self->ipc.buf));
+}
+
+static void _ipc_read2_cb(uv_pipe_t* pipe, ssize_t nread, uv_buf_t buf, uv_handle_type pending) {
+  luv_thread_t* self = (luv_thread_t*)pipe->data;
+  luv_ipc_t*    ipc  = &self->ipc;
+  luv_state_t*  s    = NULL;
+  lua_State*    L    = self->L;
+  (void)buf;
+
+  if (nread < 0) {
+    TRACE("parent closed the ipc pipe\n");
+    ipc->eof = 1;
+    uv_read_stop((uv_stream_t*)pipe);
+    while (!ngx_queue_empty(&ipc->wait)) {
+      s = ngx_queue_data(ngx_queue_head(&ipc->wait), luv_state_t, cond);
+      lua_settop(s->L, 0);
+      lua_pushnil(s->L);
+      lua_pushstring(s->L, "recv_handle: parent thread closed the pipe");
+      luvL_cond_signal(&ipc->wait);
+    }
+    return;
+  }
+  if (pending == UV_UNKNOWN_HANDLE) return;
+
+  if (!ngx_queue_empty(&ipc->wait)) {
+    /* accept straight onto the stack of the first waiting state */
+    s = ngx_queue_data(ngx_queue_head(&ipc->wait), luv_state_t, cond);
+    L = s->L;
+    lua_settop(L, 0);
+  }
+  if (!luvL_stream_accept_new(L, (uv_stream_t*)pipe, pending)) {
+    if (s) {
+      lua_pushnil(L);
+      lua_pushstring(L, uv_strerror(uv_last_error(pipe->loop)));
+      luvL_cond_signal(&ipc->wait);
+    }
+    return;
+  }
+  if (s) {
+    luvL_cond_signal(&ipc->wait);
+    return;
+  }
+  if (ipc->ref == LUA_NOREF) {
+    lua_newtable(L);
+    ipc->ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  }
+  lua_rawgeti(L, LUA_REGISTRYINDEX, ipc->ref);
+  lua_insert(L, -2);
+  lua_rawseti(L, -2, ++ipc->tail);
+  lua_pop(L, 1);
+}
+
 void luvL_thread_init_main(lua_State* L) {
   luv_thread_t* self = (luv_thread_t*)lua_newuserdata(L, sizeof(luv_thread_t));
   luaL_getmetatable(L, LUV_THREAD_T);
@@ -177,22 +270,39 @@ void luvL_thread_init_main(lua_State* L) {
   self->type  = LUV_TTHREAD;
   self->flags = LUV_FREADY;
   self->loop  = uv_default_loop();
+  self->loop->data = self;
   self->curr  = (luv_state_t*)self;
   self->L     = L;
   self->outer = (luv_state_t*)self;
   self->data  = NULL;
   self->tid   = (uv_thread_t)uv_thread_self();
 
+  self->scratch.base = NULL;
+  self->scratch.head = NULL;
+  self->scratch.size = 0;
+  luvL_pool_init(&self->pool);
+  self->accepted = 0;
+  _ipc_init(&self->ipc, 0);
+
   ngx_queue_init(&self->rouse);
+  ngx_queue_init(&self->corked);
+  ngx_queue_init(&self->resolving);
 
   uv_async_init(self->loop, &self->async, _async_cb);
   uv_unref((uv_handle_t*)&self->async);
+  uv_check_init(self->loop, &self->check);
 
   lua_pushthread(L);
   lua_pushvalue(L, -2);
   lua_rawset(L, LUA_REGISTRYINDEX);
 }
 
+/* push encoded bytes as a string directly onto another Lua state */
+static int _state_sink_write(luv_sink_t* sink, const char* data, size_t len) {
+  lua_pushlstring((lua_State*)sink->data, data, len);
+  return 0;
+}
+
 static void _thread_enter(void* arg) {
   luv_thread_t* self = (luv_thread_t*)arg;
 
@@ -207,6 +317,8 @@ static void _thread_enter(void* arg) {
   int rv = lua_pcall(self->L, nargs, LUA_MULTRET, 1);
   lua_remove(self->L, 1); /* traceback */
 
+  _ipc_close_recv(self);
+
   if (rv) { /* error */
     lua_pushboolean(self->L, 0);
     lua_insert(self->L, 1);
@@ -236,23 +348,37 @@ luv_thread_t* luvL_thread_create(luv_state_t* outer, int narg) {
   self->type  = LUV_TTHREAD;
   self->flags = LUV_FREADY;
   self->loop  = uv_loop_new();
+  self->loop->data = self;
   self->curr  = (luv_state_t*)self;
   self->L     = luaL_newstate();
   self->outer = outer;
   self->data  = NULL;
 
+  self->scratch.base = NULL;
+  self->scratch.head = NULL;
+  self->scratch.size = 0;
+  luvL_pool_init(&self->pool);
+  self->accepted = 0;
+  _ipc_init(&self->ipc, 1);
+
   ngx_queue_init(&self->rouse);
+  ngx_queue_init(&self->corked);
+  ngx_queue_init(&self->resolving);
 
   uv_async_init(self->loop, &self->async, _async_cb);
   uv_unref((uv_handle_t*)&self->async);
+  uv_check_init(self->loop, &self->check);
 
   luaL_openlibs(self->L);
   luaopen_luv(self->L);
 
   lua_settop(self->L, 0);
-  luvL_codec_encode(L, narg);
-  luaL_checktype(L, -1, LUA_TSTRING);
-  lua_xmove(L, self->L, 1);
+  luv_sink_t sink;
+  sink.write = _state_sink_write;
+  sink.take  = NULL;
+  sink.flags = 0;
+  sink.data  = self->L;
+  luvL_codec_encode_into(L, narg, &sink);
 
   /* keep a reference for reverse lookup in child */
   lua_pushthread(self->L);
@@ -285,19 +411,139 @@ static int luv_thread_join(lua_State* L) {
   lua_settop(L, 0);
 
   int nret = lua_gettop(self->L);
-  luvL_codec_encode(self->L, nret);
-  lua_xmove(self->L, L, 1);
+  luv_sink_t sink;
+  sink.write = _state_sink_write;
+  sink.take  = NULL;
+  sink.flags = 0;
+  sink.data  = L;
+  luvL_codec_encode_into(self->L, nret, &sink);
   luvL_codec_decode(L);
 
   return nret;
 }
+static void _send_handle_cb(uv_write_t* req, int status) {
+  luv_state_t*  curr = container_of(req, luv_state_t, req);
+  luv_object_t* conn = (luv_object_t*)lua_touserdata(curr->L, 2);
+  if (status) {
+    uv_err_t err = uv_last_error(req->handle->loop);
+    lua_settop(curr->L, 0);
+    lua_pushboolean(curr->L, 0);
+    lua_pushfstring(curr->L, "send_handle: %s", uv_strerror(err));
+  }
+  else {
+    /* the thread has its own copy of the socket now */
+    luvL_stream_close(conn);
+    lua_settop(curr->L, 0);
+    lua_pushboolean(curr->L, 1);
+  }
+  luvL_state_ready(curr);
+}
+
+/* thread:send_handle(tcp), move a connection to the thread, where
+** luv.thread.recv_handle() returns it. Only the spawning thread can
+** send, and `tcp' is closed on this side once it has been sent */
+static int luv_thread_send_handle(lua_State* L) {
+  luv_thread_t* self = (luv_thread_t*)luaL_checkudata(L, 1, LUV_THREAD_T);
+  luv_object_t* conn = (luv_object_t*)luaL_checkudata(L, 2, LUV_NET_TCP_T);
+  luv_state_t*  curr = luvL_state_self(L);
+  /* a handle can only travel along with some data */
+  uv_buf_t buf = uv_buf_init((char*)"h", 1);
+
+  if (self->ipc.fd[0] < 0 || curr->loop != self->outer->loop) {
+    return luaL_error(L, "send_handle: not the parent of this thread");
+  }
+
+  /* the thread gets the socket only, so nothing may have been read
+  ** ahead from it, nor be read while the handle is on its way */
+  if (luvL_object_is_started(conn)) {
+    luvL_stream_stop(conn);
+  }
+  if (conn->data) {
+    luv_rbuf_t* rbuf = &luvL_stream_io(conn)->rbuf;
+    if (rbuf->wpos > rbuf->rpos) {
+      lua_pushboolean(L, 0);
+      lua_pushliteral(L, "send_handle: stream has unread data");
+      return 2;
+    }
+  }
+  if (!self->ipc.send) {
+    self->ipc.send = (uv_pipe_t*)malloc(sizeof(uv_pipe_t));
+    uv_pipe_init(curr->loop, self->ipc.send, 1);
+    uv_pipe_open(self->ipc.send, self->ipc.fd[0]);
+  }
+
+  lua_settop(L, 2);
+  if (uv_write2(&curr->req.write, (uv_stream_t*)self->ipc.send, &buf, 1,
+    &conn->h.stream, _send_handle_cb)) {
+    uv_err_t err = uv_last_error(curr->loop);
+    lua_settop(L, 0);
+    lua_pushboolean(L, 0);
+    lua_pushfstring(L, "send_handle: %s", uv_strerror(err));
+    return 2;
+  }
+  return luvL_state_suspend(curr);
+}
+
+/* luv.thread.recv_handle(), wait for a connection sent by the parent */
+static int luv_thread_recv_handle(lua_State* L) {
+  luv_thread_t* self = luvL_thread_self(L);
+  luv_ipc_t*    ipc  = &self->ipc;
+
+  if (ipc->fd[1] < 0) {
+    return luaL_error(L, "recv_handle: no parent thread to receive from");
+  }
+  if (ipc->head < ipc->tail) {
+    lua_rawgeti(L, LUA_REGISTRYINDEX, ipc->ref);
+    lua_rawgeti(L, -1, ++ipc->head);
+    lua_pushnil(L);
+    lua_rawseti(L, -3, ipc->head);
+    if (ipc->head == ipc->tail) {
+      ipc->head = ipc->tail = 0;
+    }
+    return 1;
+  }
+  if (ipc->eof) {
+    lua_pushnil(L);
+    lua_pushstring(L, "recv_handle: parent thread closed the pipe");
+    return 2;
+  }
+  if (!ipc->recv) {
+    ipc->recv = (uv_pipe_t*)malloc(sizeof(uv_pipe_t));
+    uv_pipe_init(self->loop, ipc->recv, 1);
+    uv_pipe_open(ipc->recv, ipc->fd[1]);
+    ipc->recv->data = self;
+    uv_read2_start((uv_stream_t*)ipc->recv, _ipc_alloc_cb, _ipc_read2_cb);
+  }
+  lua_settop(L, 0);
+  return luvL_cond_wait(&ipc->wait, luvL_state_self(L));
+}
+
 static int luv_thread_free(lua_State* L) {
   luv_thread_t* self = lua_touserdata(L, 1);
   TRACE("free thread\n");
+  luvL_buf_close(&self->scratch);
+  luvL_pool_close(&self->pool);
+  if (self->ipc.send) {
+    uv_close((uv_handle_t*)self->ipc.send, _ipc_close_cb);
+  }
+#ifndef WIN32
+  else if (self->ipc.fd[0] >= 0) {
+    close(self->ipc.fd[0]);
+  }
+  if (self->ipc.fd[1] >= 0) {
+    close(self->ipc.fd[1]);
+  }
+#endif
   uv_loop_delete(self->loop);
   TRACE("ok\n");
   return 1;
 }
+/* thread:accepted(), connections accepted by listeners in the thread */
+static int luv_thread_accepted(lua_State* L) {
+  luv_thread_t* self = (luv_thread_t*)luaL_checkudata(L, 1, LUV_THREAD_T);
+  lua_pushinteger(L, (lua_Integer)self->accepted);
+  return 1;
+}
 static int luv_thread_tostring(lua_State* L) {
   luv_thread_t* self = (luv_thread_t*)luaL_checkudata(L, 1, LUV_THREAD_T);
   lua_pushfstring(L, "userdata<%s>: %p", LUV_THREAD_T, self);
@@ -306,11 +552,14 @@ static int luv_thread_tostring(lua_State* L) {
 
 luaL_Reg luv_thread_funcs[] = {
   {"spawn",     luv_new_thread},
+  {"recv_handle",luv_thread_recv_handle},
   {NULL,        NULL}
 };
 
 luaL_Reg luv_thread_meths[] = {
   {"join",      luv_thread_join},
+  {"accepted",  luv_thread_accepted},
+  {"send_handle",luv_thread_send_handle},
   {"__gc",      luv_thread_free},
   {"__tostring",luv_thread_tostring},
   {NULL,        NULL}
@@ -32,6 +32,16 @@ int luvL_zmq_socket_send(luv_object_t* self, luv_state_t* state) {
 
 int luvL_zmq_socket_recv(luv_object_t* self, luv_state_t* state) {
   zmq_msg_t msg;
+  luv_buffer_t* into = luvL_buffer_test(state->L, 2);
+  if (into) {
+    /* recv_into, zmq truncates and returns the full message size */
+    int rv = zmq_recv(self->data, into->data, into->size, ZMQ_DONTWAIT);
+    if (rv >= 0) {
+      lua_settop(state->L, 0);
+      lua_pushinteger(state->L, rv);
+    }
+    return rv;
+  }
   zmq_msg_init(&msg);
 
   int rv = zmq_msg_recv(&msg, self->data, ZMQ_DONTWAIT);
@@ -187,6 +197,74 @@ static int luv_zmq_socket_send(lua_State* L) {
   }
   return 2;
 }
+static void _zmq_msg_free(void* data, void* hint) {
+  (void)data;
+  free(hint);
+}
+
+/* the zmq message adopts the encode buffer, no intermediate Lua string
+** and no copy */
+static int _zmq_msg_sink_take(luv_sink_t* sink, char* data, size_t len, void* block) {
+  zmq_msg_t* msg = (zmq_msg_t*)sink->data;
+  if (zmq_msg_init_data(msg, data, len, _zmq_msg_free, block)) {
+    free(block);
+    return -1;
+  }
+  return 0;
+}
+
+/* socket:compress(on), compress large send_value payloads */
+static int luv_zmq_socket_compress(lua_State* L) {
+  luv_object_t* self = (luv_object_t*)luaL_checkudata(L, 1, LUV_ZMQ_SOCKET_T);
+  if (lua_toboolean(L, 2)) {
+    self->flags |= LUV_ZMQ_XCOMPRESS;
+  }
+  else {
+    self->flags &= ~LUV_ZMQ_XCOMPRESS;
+  }
+  return 0;
+}
+
+static int luv_zmq_socket_send_value(lua_State* L) {
+  luv_object_t* self = (luv_object_t*)luaL_checkudata(L, 1, LUV_ZMQ_SOCKET_T);
+  luv_state_t*  curr = luvL_state_self(L);
+
+  zmq_msg_t  msg;
+  luv_sink_t sink;
+  sink.write = NULL;
+  sink.take  = _zmq_msg_sink_take;
+  sink.flags = 0;
+  sink.data  = &msg;
+  if (self->flags & LUV_ZMQ_XCOMPRESS) sink.flags |= LUV_CODEC_FCOMPRESS;
+
+  if (luvL_codec_encode_into(L, lua_gettop(L) - 1, &sink)) {
+    /* ENOMEM */
+    return luaL_error(L, "%s", strerror(errno));
+  }
+
+  int rv = zmq_msg_send(&msg, self->data, ZMQ_DONTWAIT);
+  if (rv < 0) {
+    int err = zmq_errno();
+    if (err == EAGAIN || err == EWOULDBLOCK) {
+      TRACE("EAGAIN during SEND, polling...\n");
+      /* slow path: park the payload as a string for _zmq_poll_cb */
+      lua_settop(L, 1);
+      lua_pushlstring(L, (const char*)zmq_msg_data(&msg), zmq_msg_size(&msg));
+      zmq_msg_close(&msg);
+      self->flags |= LUV_ZMQ_WSEND;
+      return luvL_cond_wait(&self->queue, curr);
+    }
+    zmq_msg_close(&msg);
+    lua_settop(L, 0);
+    lua_pushboolean(L, 0);
+    lua_pushstring(L, zmq_strerror(err));
+    return 2;
+  }
+  zmq_msg_close(&msg);
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
 static int luv_zmq_socket_recv(lua_State* L) {
   luv_object_t* self = (luv_object_t*)luaL_checkudata(L, 1, LUV_ZMQ_SOCKET_T);
   luv_state_t*  curr = luvL_state_self(L);
@@ -208,6 +286,15 @@ static int luv_zmq_socket_recv(lua_State* L) {
   return 1;
 }
 
+/* socket:recv_into(buf), receive a message into `buf'. Returns the size
+** of the message, which is larger than #buf if it was truncated */
+static int luv_zmq_socket_recv_into(lua_State* L) {
+  luaL_checkudata(L, 1, LUV_ZMQ_SOCKET_T);
+  luaL_checkudata(L, 2, LUV_BUFFER_T);
+  lua_settop(L, 2);
+  return luv_zmq_socket_recv(L);
+}
+
 static int luv_zmq_socket_close(lua_State* L) {
   luv_object_t* self = (luv_object_t*)luaL_checkudata(L, 1, LUV_ZMQ_SOCKET_T);
   if (!luvL_object_is_closing(self)) {
@@ -516,7 +603,10 @@ luaL_Reg luv_zmq_socket_meths[] = {
   {"bind",      luv_zmq_socket_bind},
   {"connect",   luv_zmq_socket_connect},
   {"send",      luv_zmq_socket_send},
+  {"send_value",luv_zmq_socket_send_value},
+  {"compress",  luv_zmq_socket_compress},
   {"recv",      luv_zmq_socket_recv},
+  {"recv_into", luv_zmq_socket_recv_into},
   {"close",     luv_zmq_socket_close},
   {"getsockopt",luv_zmq_socket_getsockopt},
   {"setsockopt",luv_zmq_socket_setsockopt},